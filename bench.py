@@ -0,0 +1,123 @@
+#!/usr/bin/python3
+#-*- encoding: utf-8 -*-
+
+'''
+Benchmarks the simulator on the predefined templates.
+
+Every template is run on synthetic frames of the given sizes and on the
+images in img/, once with every thread count, each in a process of its
+own with OMP_NUM_THREADS set. One JSON object is printed per run:
+  template, frame, w, h - what was run
+  threads - the number of OpenMP threads
+  steps, t - the steps taken and the time simulated, as reported by run
+  seconds - the best wall clock time of the repeats
+  step_seconds, cells_per_second - seconds per step and cell updates per second
+  efficiency - the speedup over the fewest threads divided by the ratio of
+               the thread counts, 1 for perfect scaling
+  checksum - MD5 of the output as doubles, which doesn't depend on the
+             number of threads; match tells whether it is the same as with
+             the fewest threads
+Progress goes to the standard error.
+'''
+
+import argparse
+import array
+import glob
+import hashlib
+import json
+import os
+import subprocess
+import sys
+import time
+
+def synthetic(w, h):
+	# diagonal stripes of 17 grey levels, so a frame is made of 17 distinct rows
+	rows = []
+	for k in range(17):
+		row = array.array("d", [0.0]*(w+2))
+		for x in range(w):
+			row[x+1] = ((x*7 + k) % 17)/8.0 - 1.0
+		rows.append(row)
+	items = array.array("d", [0.0]*(w+2))
+	for y in range(h):
+		items.extend(rows[(y*13) % 17])
+	items.extend(array.array("d", [0.0]*(w+2)))
+	return Matrix.wrap(memoryview(items).cast("B").cast("d", (h+2, w+2)), halo = 1)
+
+def checksum(m):
+	raw = m.buffer().tobytes()
+	row = 8*m.stride
+	start = 8*m.halo*(m.stride + 1)
+	md5 = hashlib.md5()
+	for y in range(m.h):
+		md5.update(raw[start + y*row : start + y*row + 8*m.w])
+	return md5.hexdigest()
+
+def frames(args):
+	for size in args.sizes:
+		w, h = [int(v) for v in size.split("x")] if "x" in size else (int(size), int(size))
+		yield "synthetic", lambda w=w, h=h: synthetic(w, h)
+	for path in args.images:
+		yield os.path.basename(path), lambda path=path: load_image(path)
+
+def templates(args):
+	import cnn
+	names = args.templates or sorted(k for k, v in vars(cnn).items() if type(v) is Template)
+	return [(name, getattr(cnn, name)) for name in names]
+
+def child(args):
+	for frame, make in frames(args):
+		m = make()
+		for name, tem in templates(args):
+			best = None
+			for i in range(args.repeat):
+				start = time.perf_counter()
+				res, reports = run(m, None, tem, precision = args.precision, jit = args.jit, report = True)
+				seconds = time.perf_counter() - start
+				best = seconds if best is None else min(best, seconds)
+			steps = reports[0]["steps"]
+			print(json.dumps({"template": name, "frame": frame, "w": m.w, "h": m.h,
+			                  "steps": steps, "t": reports[0]["t"], "seconds": best,
+			                  "step_seconds": best/max(steps, 1),
+			                  "cells_per_second": m.w*m.h*steps/best,
+			                  "checksum": checksum(res)}), flush = True)
+			print("%s on %s %dx%d: %.3fs" % (name, frame, m.w, m.h, best), file = sys.stderr, flush = True)
+
+def parent(args):
+	threads = sorted(set(args.threads))
+	runs = {}
+	for p in threads:
+		print("%d threads" % p, file = sys.stderr, flush = True)
+		env = dict(os.environ, OMP_NUM_THREADS = str(p))
+		out = subprocess.run([sys.executable, __file__, "--child"] + sys.argv[1:], env = env,
+		                     stdout = subprocess.PIPE, check = True, universal_newlines = True).stdout
+		runs[p] = [json.loads(line) for line in out.splitlines()]
+
+	base = threads[0]
+	for p in threads:
+		for ref, rec in zip(runs[base], runs[p]):
+			rec["threads"] = p
+			rec["efficiency"] = ref["seconds"]*base/(rec["seconds"]*p)
+			rec["match"] = rec["checksum"] == ref["checksum"]
+			print(json.dumps(rec))
+
+parser = argparse.ArgumentParser(description = "Benchmark the simulator on the predefined templates.")
+parser.add_argument("--templates", nargs = "*", help = "templates to run, all predefined ones by default")
+parser.add_argument("--sizes", nargs = "*", default = ["256", "1024"],
+                    help = "sizes of the synthetic frames, N or WxH")
+parser.add_argument("--images", nargs = "*", default = sorted(glob.glob("img/*.jpg")), help = "images to run on")
+cpus = os.cpu_count() or 1
+parser.add_argument("--threads", nargs = "*", type = int,
+                    default = sorted(set([1, cpus] + [1 << i for i in range(cpus.bit_length()) if 1 << i < cpus])),
+                    help = "OpenMP thread counts, 1, the powers of two and all cores by default")
+parser.add_argument("--repeat", type = int, default = 3, help = "runs per measurement, the fastest one counts")
+parser.add_argument("--precision", default = "double", help = "precision of the state, as for run")
+parser.add_argument("--jit", action = "store_true", help = "compile the templates, as for run")
+parser.add_argument("--child", action = "store_true", help = argparse.SUPPRESS)
+args = parser.parse_args()
+
+if args.child:
+	from cnn import *
+	child(args)
+else:
+	parent(args)
@@ -15,34 +15,154 @@
 #include <stdlib.h>
 #include <SDL.h>
 #include <SDL_image.h>
+#include <omp.h>
 #include "cnn.h"
+#include "stencil.h"
+#include "solver.h"
+#include "compact.h"
+#include "jit.h"
+#include "pool.h"
+#include "display.h"
+#include "distributed.h"
+#include "stream.h"
 
 const matrix NULLMAT = {0, 0, NULL};
+const convergence NOCONV = {0, 0};
+
+static _Thread_local cnn_stats *profile = NULL;
+
+void profile_into(cnn_stats *st)
+{
+    if (st)
+    {
+        memset(st, 0, sizeof(cnn_stats));
+        const int n = omp_get_max_threads();
+        st->threads = n < STATS_THREADS ? n : STATS_THREADS;
+    }
+    profile = st;
+}
+
+cnn_stats *profiling()
+{
+    return profile;
+}
+
+double stats_clock()
+{
+    return omp_get_wtime();
+}
+
+/* Only the profiled thread records phases, so they need no locking. */
+void stats_phase(cnn_stats *st, int phase, double start)
+{
+    st->seconds[phase] += omp_get_wtime() - start;
+    ++st->calls[phase];
+}
+
+/* Any thread of a parallel region may record the cells it evaluated since start. */
+void stats_work(cnn_stats *st, size_t cells, double start)
+{
+    const double seconds = omp_get_wtime() - start;
+    const int t = omp_get_thread_num() % STATS_THREADS;
+    #pragma omp atomic
+    st->thread_seconds[t] += seconds;
+    #pragma omp atomic
+    st->thread_cells[t] += cells;
+    #pragma omp atomic
+    st->cells += cells;
+}
 
 inline
 matrix create_matrix(size_t w, size_t h)
 {
-    matrix mat = {w, h, (double*) malloc(sizeof(double)*w*h)};
+    matrix mat = {w, h, (double*) pool_alloc(sizeof(double)*w*h), w, 0};
+    if (profile)
+    {
+        ++profile->allocations;
+        profile->bytes += sizeof(double)*w*h;
+    }
     return mat;
 }
 
+/* The halo cells are left as they are; the boundary conditions fill them. */
+matrix create_padded_matrix(size_t w, size_t h, size_t s)
+{
+    return matrix_interior(create_matrix(w + 2*s, h + 2*s), s);
+}
+
+/* The whole storage of m, halo included, as a plane without a halo. */
+matrix matrix_plane(matrix m)
+{
+    matrix plane = {m.w + 2*m.halo, m.h + 2*m.halo, m.data - m.halo*(m.stride + 1), m.stride, 0};
+    return plane;
+}
+
+/* The inner part of a plane, with the s cells at its edges as its halo. */
+matrix matrix_interior(matrix plane, size_t s)
+{
+    matrix mat = {plane.w - 2*s, plane.h - 2*s, plane.data + s*(plane.stride + 1), plane.stride, s};
+    return mat;
+}
+
+/* A copy of m with a halo of s cells, for a simulator padding by s. */
+matrix pad_matrix(matrix m, size_t s)
+{
+    cnn_stats *st = profile;
+    const double start = st ? stats_clock() : 0;
+    matrix res = create_padded_matrix(m.w, m.h, s);
+
+    for (size_t i = 0; i<m.h; ++i)
+    {
+        memcpy(res.data + i*res.stride, m.data + i*m.stride, sizeof(double)*m.w);
+    }
+
+    if (st)
+    {
+        stats_phase(st, PHASE_COPY, start);
+    }
+    return res;
+}
+
+/* The copy has the same halo, and the halo cells are copied as well. */
 matrix copy_matrix(matrix m)
 {
-    matrix newmat = create_matrix(m.w, m.h);
-    memcpy(newmat.data, m.data, sizeof(double)*m.w*m.h);
-    return newmat;
+    cnn_stats *st = profile;
+    const double start = st ? stats_clock() : 0;
+    const matrix src = matrix_plane(m);
+    matrix dst = create_matrix(src.w, src.h);
+
+    if (src.stride == src.w)
+    {
+        memcpy(dst.data, src.data, sizeof(double)*src.w*src.h);
+    }
+    else
+    {
+        for (size_t i = 0; i<src.h; ++i)
+        {
+            memcpy(dst.data + i*dst.stride, src.data + i*src.stride, sizeof(double)*src.w);
+        }
+    }
+
+    if (st)
+    {
+        stats_phase(st, PHASE_COPY, start);
+    }
+    return matrix_interior(dst, m.halo);
 }
 
 inline
 void free_matrix(matrix m)
 {
-    free(m.data);
+    pool_free(m.halo ? matrix_plane(m).data : m.data);
 }
 
 inline
 void fill_matrix(matrix m, double val)
 {
-    memset(m.data, val, sizeof(double)*m.w*m.h);
+    for (size_t i = 0; i<m.h; ++i)
+    {
+        memset(m.data + i*m.stride, val, sizeof(double)*m.w);
+    }
 }
 
 double phi(double x)
@@ -61,76 +181,84 @@ double phi(double x)
     }
 }
 
-SDL_Color get_pixel(SDL_Surface *surf, int x, int y) 
-{
-    const SDL_PixelFormat *fmt = surf->format;
-    const int i = surf->pitch*y + fmt->BytesPerPixel*x;
-    const Uint32 pixel = *(Uint32*) ((Uint8*) surf->pixels + i);
-
-    SDL_Color c;
-    SDL_GetRGB(pixel, fmt, &c.r, &c.g, &c.b);
-    return c;
-}
-
-void set_pixel(SDL_Surface *surf, int x, int y, SDL_Color rgb)
+/*
+   The image is converted once to 24 bit RGB, whose bytes are red, green
+   and blue in this order on every machine, and then read a row at a time.
+*/
+matrix img_to_data(SDL_Surface *img, size_t s)
 {
-    const SDL_PixelFormat *fmt = surf->format;
-    const int i = surf->pitch*y + fmt->BytesPerPixel*x;
-    Uint32 pixel = *(Uint32*) ((Uint8*) surf->pixels + i);
-    pixel &= ~fmt->Rmask;
-    pixel &= ~fmt->Gmask;
-    pixel &= ~fmt->Bmask;
-    pixel &= ~fmt->Amask;
-
-    pixel |= SDL_MapRGB(fmt, rgb.r, rgb.g, rgb.b);
-    *(Uint32*) ((Uint8*) surf->pixels + i) = pixel;
-}
+    cnn_stats *st = profile;
+    const double start = st ? stats_clock() : 0;
+    SDL_Surface *rgb = SDL_ConvertSurfaceFormat(img, SDL_PIXELFORMAT_RGB24, 0);
+    if (!rgb)
+    {
+        fputs(SDL_GetError(), stderr);
+        return NULLMAT;
+    }
 
-matrix img_to_data(SDL_Surface *img)
-{
-    matrix mat = create_matrix(img->w, img->h);
+    matrix mat = create_padded_matrix(rgb->w, rgb->h, s);
+    SDL_LockSurface(rgb);
 
-    for (int i = 0; i<img->w; ++i)
+    #pragma omp parallel for
+    for (int j = 0; j<rgb->h; ++j)
     {
-        for (int j = 0; j<img->h; ++j)
+        const Uint8 *src = (const Uint8*) rgb->pixels + j*rgb->pitch;
+        double *row = mat.data + j*mat.stride;
+        #pragma omp simd
+        for (int i = 0; i<rgb->w; ++i)
         {
-            SDL_Color cl = get_pixel(img, i, j);
-            const double y = (0.2126*cl.r + 0.7152*cl.g + 0.0722*cl.b)/-127.5 + 1;
-            mat.data[j*img->w + i] = y;
+            row[i] = (0.2126*src[3*i] + 0.7152*src[3*i+1] + 0.0722*src[3*i+2])/-127.5 + 1;
         }
     }
 
+    SDL_UnlockSurface(rgb);
+    SDL_FreeSurface(rgb);
+    if (st)
+    {
+        stats_phase(st, PHASE_LOAD, start);
+    }
     return mat;
 }
 
+/*
+   An 8 bit surface with a grey palette, which is saved as an 8 bit PNG.
+   The grey levels are those of encode_row, so -1 is white, 1 is black and
+   levels read by load_image are written back unchanged.
+*/
 SDL_Surface *data_to_img(matrix data)
 {
-    SDL_Surface *surf = SDL_CreateRGBSurface(SDL_SWSURFACE, data.w,
-                                             data.h, 24,
-                                             0xff000000,
-                                             0x00ff0000,
-                                             0x0000ff00,
-                                             0);
+    cnn_stats *st = profile;
+    const double start = st ? stats_clock() : 0;
+    SDL_Surface *surf = SDL_CreateRGBSurfaceWithFormat(0, data.w, data.h, 8, SDL_PIXELFORMAT_INDEX8);
     if (!surf)
     {
         fputs(SDL_GetError(), stderr);
         return NULL;
     }
-    #pragma omp parallel for collapse(2)
-    for (size_t i = 0; i<data.w; ++i)
+
+    SDL_Color grey[256];
+    for (int i = 0; i<256; ++i)
     {
-        for (size_t j = 0; j<data.h; ++j)
-        {
-            const Uint8 rgb = (data.data[j*data.w + i]-1) * -127;
-            const SDL_Color c = {rgb, rgb, rgb, 0};
-            set_pixel(surf, i, j, c);
-        }
+        grey[i] = (SDL_Color) {i, i, i, 255};
+    }
+    SDL_SetPaletteColors(surf->format->palette, grey, 0, 256);
+
+    SDL_LockSurface(surf);
+    #pragma omp parallel for
+    for (size_t j = 0; j<data.h; ++j)
+    {
+        encode_row((Uint8*) surf->pixels + j*surf->pitch, data.data + j*data.stride, data.w);
     }
+    SDL_UnlockSurface(surf);
 
+    if (st)
+    {
+        stats_phase(st, PHASE_SAVE, start);
+    }
     return surf;
 }
 
-matrix load_image(const char *file)
+matrix load_image(const char *file, size_t s)
 {
     SDL_Surface *img = IMG_Load(file);
     if (!img)
@@ -139,71 +267,110 @@ matrix load_image(const char *file)
         return NULLMAT;
     }
 
-    matrix data = img_to_data(img);
+    matrix data = img_to_data(img, s);
     SDL_FreeSurface(img);
 
     return data;
 }
 
-void save_image(SDL_Surface *surf, const char *file)
+int save_image(SDL_Surface *surf, const char *file)
 {
     if (IMG_SavePNG(surf, file))
     {
         fputs(IMG_GetError(), stderr);
+        return 0;
     }
+    return 1;
+}
+
+int save_matrix(matrix m, const char *file)
+{
+    SDL_Surface *surf = data_to_img(m);
+    if (!surf)
+    {
+        return 0;
+    }
+    const int ok = save_image(surf, file);
+    SDL_FreeSurface(surf);
+    return ok;
 }
 
 matrix expand_matrix(matrix m, size_t s)
 {
-    matrix res = create_matrix(m.w + 2, m.h + 2);
+    cnn_stats *st = profile;
+    const double start = st ? stats_clock() : 0;
+    matrix res = create_matrix(m.w + 2*s, m.h + 2*s);
 
-    for (size_t i = 1; i<res.h-1; ++i)
+    for (size_t i = s; i<res.h-s; ++i)
     {
-        memcpy(res.data + i*res.w + 1, m.data + (i-1)*m.w, sizeof(double)*m.w);
+        memcpy(res.data + i*res.w + s, m.data + (i-s)*m.stride, sizeof(double)*m.w);
     }
 
+    if (st)
+    {
+        stats_phase(st, PHASE_COPY, start);
+    }
     return res;
 }
 
 matrix shrink_matrix(matrix m, size_t s)
 {
-    matrix res = create_matrix(m.w - 2, m.h - 2);
+    cnn_stats *st = profile;
+    const double start = st ? stats_clock() : 0;
+    matrix res = create_matrix(m.w - 2*s, m.h - 2*s);
 
     for (size_t i = 0; i<res.h; ++i)
     {
-        memcpy(res.data + i*res.w, m.data + (i+1)*m.w + 1, sizeof(double)*res.w);
+        memcpy(res.data + i*res.w, m.data + (i+s)*m.stride + s, sizeof(double)*res.w);
     }
 
+    if (st)
+    {
+        stats_phase(st, PHASE_COPY, start);
+    }
     return res;
 }
 
 void fill_bounds(matrix m, size_t s, double val)
 {
+    cnn_stats *st = profile;
+    const double start = st ? stats_clock() : 0;
     for (size_t i = 0; i<s; ++i)
     {
+        double *top = m.data + i*m.w,
+               *bottom = m.data + (m.h-1-i)*m.w;
         for (size_t j = 0; j<m.w; ++j)
         {
-            m.data[m.w*i + j] = val;
-            m.data[m.w*(m.h-1-i) + j] = val;
+            top[j] = val;
+            bottom[j] = val;
         }
+    }
 
-        for (size_t j = 0; j<m.h; ++j)
+    for (size_t j = s; j<m.h-s; ++j)
+    {
+        double *row = m.data + j*m.w;
+        for (size_t i = 0; i<s; ++i)
         {
-            m.data[m.w*j + i] = val;
-            m.data[m.w*(m.h-1-j) + i] = val;
+            row[i] = val;
+            row[m.w-1-i] = val;
         }
     }
+
+    if (st)
+    {
+        stats_phase(st, PHASE_BOUND, start);
+    }
 }
 
 size_t count_blacks(matrix m, size_t s)
 {
     size_t blacks = 0;
-    #pragma omp parallel for collapse(2) reduction(+:blacks)
-    for (size_t i = s; i<m.w-s; ++i)
+    #pragma omp parallel for reduction(+:blacks)
+    for (size_t j = s; j<m.h-s; ++j)
     {
-        for (size_t j = s; j<m.h-s; ++j)
+        for (size_t i = s; i<m.w-s; ++i)
         {
-            if (m.data[j*m.w + i] >= 1.0)
+            if (m.data[j*m.stride + i] >= 1.0)
             {
                 blacks++;
             }
@@ -217,7 +384,7 @@ size_t count_blacks_left(matrix m, size_t s)
     size_t blacks = 0;
     for (size_t i = s; i<m.h; ++i)
     {
-        if (m.data[i*m.w + s] >= 1.0)
+        if (m.data[i*m.stride + s] >= 1.0)
         {
             blacks++;
         }
@@ -230,7 +397,7 @@ size_t count_blacks_right(matrix m, size_t s)
     size_t blacks = 0;
     for (size_t i = s; i<m.h; ++i)
     {
-        if (m.data[i*m.w + m.w-s-1] >= 1.0)
+        if (m.data[i*m.stride + m.w-s-1] >= 1.0)
         {
             blacks++;
         }
@@ -243,7 +410,7 @@ size_t count_blacks_top(matrix m, size_t s)
     size_t blacks = 0;
     for (size_t i = s; i<m.w-s; ++i)
     {
-        if (m.data[s*m.w + i] >= 1.0)
+        if (m.data[s*m.stride + i] >= 1.0)
         {
             blacks++;
         }
@@ -256,7 +423,7 @@ size_t count_blacks_bottom(matrix m, size_t s)
     size_t blacks = 0;
     for (size_t i = s; i<m.w-s; ++i)
     {
-        if (m.data[(m.h-s-1)*m.w + i] >= 1.0)
+        if (m.data[(m.h-s-1)*m.stride + i] >= 1.0)
         {
             blacks++;
         }
@@ -267,15 +434,15 @@ size_t count_blacks_bottom(matrix m, size_t s)
 double linear3x3(size_t x, size_t y, matrix state, matrix input1, matrix input2, double t, void *tem)
 {
     template3x3 *tmpl = (template3x3*) tem;
-    return phi((state.data[state.w*(y-1) + x-1]) * tmpl->a[0]) +
-           phi((state.data[state.w*(y-1) + x  ]) * tmpl->a[1]) +
-           phi((state.data[state.w*(y-1) + x+1]) * tmpl->a[2]) +
-           phi((state.data[state.w*(y  ) + x-1]) * tmpl->a[3]) +
-           phi((state.data[state.w*(y  ) + x  ]) * tmpl->a[4]) +
-           phi((state.data[state.w*(y  ) + x+1]) * tmpl->a[5]) +
-           phi((state.data[state.w*(y+1) + x-1]) * tmpl->a[6]) +
-           phi((state.data[state.w*(y+1) + x  ]) * tmpl->a[7]) +
-           phi((state.data[state.w*(y+1) + x+1]) * tmpl->a[8]) +
+    return phi(state.data[state.w*(y-1) + x-1]) * tmpl->a[0] +
+           phi(state.data[state.w*(y-1) + x  ]) * tmpl->a[1] +
+           phi(state.data[state.w*(y-1) + x+1]) * tmpl->a[2] +
+           phi(state.data[state.w*(y  ) + x-1]) * tmpl->a[3] +
+           phi(state.data[state.w*(y  ) + x  ]) * tmpl->a[4] +
+           phi(state.data[state.w*(y  ) + x+1]) * tmpl->a[5] +
+           phi(state.data[state.w*(y+1) + x-1]) * tmpl->a[6] +
+           phi(state.data[state.w*(y+1) + x  ]) * tmpl->a[7] +
+           phi(state.data[state.w*(y+1) + x+1]) * tmpl->a[8] +
            input1.data[input1.w*(y-1) + x-1] * tmpl->b[0] +
            input1.data[input1.w*(y-1) + x  ] * tmpl->b[1] +
            input1.data[input1.w*(y-1) + x+1] * tmpl->b[2] +
@@ -288,7 +455,6 @@ double linear3x3(size_t x, size_t y, matrix state, matrix input1, matrix input2,
            -state.data[state.w*y + x] + tmpl->z;
 }
 
-
 double nonlinear3x3(size_t x, size_t y, matrix state, matrix input1, matrix input2, double t, void *tem)
 {
     template3x3 *tmpl = (template3x3*) tem;
@@ -377,40 +543,105 @@ double nonlinear3x3(size_t x, size_t y, matrix state, matrix input1, matrix inpu
            + tmpl->phi(kl[tmpl->dkl][8]-ij[tmpl->dij],tmpl->phi_data)*tmpl->d[8];
 }
 
-void bound_periodic(matrix state, size_t s)
+double linearnxn(size_t x, size_t y, matrix state, matrix input1, matrix input2, double t, void *tem)
 {
-    for (int i = 0; i<s; ++i)
+    templatenxn *tmpl = (templatenxn*) tem;
+    const size_t r = tmpl->r,
+                 k = 2*r + 1;
+    double sum = -state.data[state.w*y + x] + tmpl->z;
+
+    for (size_t j = 0; j<k; ++j)
     {
-        for (size_t j = 0; j<state.w; ++j)
+        const double *xr = state.data + state.w*(y+j-r) + x-r,
+                     *ur = input1.data + input1.w*(y+j-r) + x-r;
+        for (size_t i = 0; i<k; ++i)
         {
-            state.data[state.w*i + j] = state.data[(state.h-2*s+i)*state.w + j];
-            state.data[state.w*(state.h-i-1) + j] = state.data[state.w*(2*s-1-i) + j];
+            sum += phi(xr[i])*tmpl->a[j*k + i] + ur[i]*tmpl->b[j*k + i];
         }
+    }
+
+    return sum;
+}
 
-        for (size_t j = 0; j<state.h; ++j)
+double nonlinearnxn(size_t x, size_t y, matrix state, matrix input1, matrix input2, double t, void *tem)
+{
+    templatenxn *tmpl = (templatenxn*) tem;
+    const size_t r = tmpl->r,
+                 k = 2*r + 1;
+    const matrix planes[4] = {state, state, input1, input2};
+    const matrix pij = planes[tmpl->dij],
+                 pkl = planes[tmpl->dkl];
+    const double ij = tmpl->dij == 1 ? phi(pij.data[pij.w*y + x]) : pij.data[pij.w*y + x];
+
+    double sum = linearnxn(x, y, state, input1, input2, t, tem);
+    for (size_t j = 0; j<k; ++j)
+    {
+        for (size_t i = 0; i<k; ++i)
         {
-            state.data[state.w*j + i] = state.data[state.w*j + state.w-2*s+i];
-            state.data[state.w*j + state.w-i-1] = state.data[state.w*j + 2*s-1-i];
+            const double dv = tmpl->d[j*k + i];
+            if (dv != 0)
+            {
+                double kl = pkl.data[pkl.w*(y+j-r) + x+i-r];
+                kl = tmpl->dkl == 1 ? phi(kl) : kl;
+                sum += tmpl->phi(kl - ij, tmpl->phi_data)*dv;
+            }
         }
     }
+
+    return sum;
 }
 
-void bound_zeroflux(matrix state, size_t s)
+/*
+   The boundary conditions fill the side halo of the inner rows first, one
+   short contiguous run per row and side, then copy whole rows above and
+   below, which also fills the corners.
+*/
+void bound_periodic(matrix state, size_t s)
 {
-    for (int i = 0; i<s; ++i)
+    const size_t w = state.w,
+                 h = state.h;
+
+    for (size_t j = s; j<h-s; ++j)
     {
-        for (size_t j = 0; j<state.w; ++j)
+        double *row = state.data + j*w;
+        #pragma omp simd
+        for (size_t i = 0; i<s; ++i)
         {
-            state.data[state.w*i + j] = state.data[state.w*s + j];
-            state.data[state.w*(state.h-i-1) + j] = state.data[state.w*(state.h-s-1) + j];
+            row[i] = row[w-2*s+i];
+            row[w-s+i] = row[s+i];
         }
+    }
 
-        for (size_t j = 0; j<state.h; ++j)
+    for (size_t i = 0; i<s; ++i)
+    {
+        memcpy(state.data + i*w, state.data + (h-2*s+i)*w, sizeof(double)*w);
+        memcpy(state.data + (h-s+i)*w, state.data + (s+i)*w, sizeof(double)*w);
+    }
+}
+
+void bound_zeroflux(matrix state, size_t s)
+{
+    const size_t w = state.w,
+                 h = state.h;
+
+    for (size_t j = s; j<h-s; ++j)
+    {
+        double *row = state.data + j*w;
+        const double left = row[s],
+                     right = row[w-1-s];
+        #pragma omp simd
+        for (size_t i = 0; i<s; ++i)
         {
-            state.data[state.w*j + i] = state.data[state.w*j + s];
-            state.data[state.w*j + state.w-i-1] = state.data[state.w*j + state.w-s-1];
+            row[i] = left;
+            row[w-1-i] = right;
         }
     }
+
+    for (size_t i = 0; i<s; ++i)
+    {
+        memcpy(state.data + i*w, state.data + s*w, sizeof(double)*w);
+        memcpy(state.data + (h-1-i)*w, state.data + (h-1-s)*w, sizeof(double)*w);
+    }
 }
 
 void bound_constant(matrix state, size_t s) {}
@@ -481,31 +712,86 @@ double nonlin_pw_linear(double val, void *data)
     return val*p[(int) p[0]-2] + p[(int) p[0]-1];
 }
 
+/*
+   Every grey level is mapped to the pixel format of the window once per
+   frame, and the frame is turned into grey levels by encode_row.
+*/
 void update_animate(matrix m, void *data)
 {
     SDL_Window *window = (SDL_Window*) data;
     SDL_Surface *screen = SDL_GetWindowSurface(window);
-    #pragma omp parallel for collapse(2)
-    for (size_t x = 0; x<m.w; ++x)
+    const int bpp = screen->format->BytesPerPixel;
+    const size_t w = m.w < (size_t) screen->w ? m.w : (size_t) screen->w,
+                 h = m.h < (size_t) screen->h ? m.h : (size_t) screen->h;
+
+    Uint32 pixel[256];
+    for (int i = 0; i<256; ++i)
+    {
+        pixel[i] = SDL_MapRGB(screen->format, i, i, i);
+    }
+
+    Uint8 *levels = (Uint8*) pool_alloc(w*h);
+
+    if (SDL_MUSTLOCK(screen))
+    {
+        SDL_LockSurface(screen);
+    }
+    #pragma omp parallel for
+    for (size_t y = 0; y<h; ++y)
     {
-        for (size_t y = 0; y<m.h; ++y)
+        Uint8 *grey = levels + y*w;
+        encode_row(grey, m.data + y*m.stride, w);
+        Uint8 *row = (Uint8*) screen->pixels + y*screen->pitch;
+        if (bpp == 4)
         {
-            int rgb = (m.data[y*m.w+x]-1)*-127.5;
-            rgb = rgb > 255 ? 255 : rgb;
-            rgb = rgb < 0 ? 0 : rgb;
-            SDL_Color c = {rgb, rgb, rgb, 0};
-            set_pixel(screen, x, y, c);
+            for (size_t x = 0; x<w; ++x)
+            {
+                ((Uint32*) row)[x] = pixel[grey[x]];
+            }
         }
+        else
+        {
+            for (size_t x = 0; x<w; ++x)
+            {
+                memcpy(row + x*bpp, pixel + grey[x], bpp);
+            }
+        }
+    }
+    if (SDL_MUSTLOCK(screen))
+    {
+        SDL_UnlockSurface(screen);
     }
+    pool_free(levels);
+
     SDL_UpdateWindowSurface(window);
 }
 
 void update_nothing(matrix m, void *data) {}
 
-matrix run_cnn(matrix init, matrix input1_, matrix input2_, size_t s,
-               double (*cell)(size_t, size_t, matrix, matrix, matrix, double, void*),
-               void *cell_data, void (*bnd)(matrix, size_t), double dt, double t_end,
-               void (*update)(matrix, void*), void *update_data)
+typedef struct
+{
+    double (*cell)(size_t, size_t, matrix, matrix, matrix, double, void*);
+    void *cell_data;
+    matrix input1, input2;
+} cell_engine;
+
+static void cell_eval(matrix dx, matrix x, double t, rect r, void *engine)
+{
+    cell_engine *e = (cell_engine*) engine;
+
+    for (size_t y = r.y0; y<r.y1; ++y)
+    {
+        for (size_t i = r.x0; i<r.x1; ++i)
+        {
+            dx.data[y*dx.w + i] = e->cell(i, y, x, e->input1, e->input2, t, e->cell_data);
+        }
+    }
+}
+
+matrix run_cnn_state(matrix init, matrix input1_, matrix input2_, size_t s,
+                     double (*cell)(size_t, size_t, matrix, matrix, matrix, double, void*),
+                     void *cell_data, void (*bnd)(matrix, size_t), double dt, double t_end, int solver,
+                     run_options opt, run_info *info, void (*update)(matrix, void*), void *update_data)
 {
     matrix buf1 = copy_matrix(init),
            buf2 = copy_matrix(init),
@@ -514,47 +800,169 @@ matrix run_cnn(matrix init, matrix input1_, matrix input2_, size_t s,
 
     matrix *state = &buf1,
            *next_state = &buf2;
-    
+
+    cnn_stats *st = profile;
+    double start = st ? stats_clock() : 0;
     bnd(input1, s);
     bnd(input2, s);
+    if (st)
+    {
+        stats_phase(st, PHASE_BOUND, start);
+    }
+
+    const int linear = cell == linear3x3 || cell == linearnxn;
+    const int reduced = cell == linear3x3 && compact_supported(opt.precision, solver, opt.active_tol,
+                                                                   opt.block_steps, bnd);
+    const jit_kernel kernel = opt.jit && !reduced && (cell == linear3x3 || cell == nonlinear3x3)
+                              ? jit_compile((template3x3*) cell_data, cell == nonlinear3x3) : NULL;
+
+    /* other nonlinear templates get their D part evaluated natively, if phi is a built-in one */
+    templatenxn view;
+    if (cell == nonlinear3x3)
+    {
+        const template3x3 *t = (const template3x3*) cell_data;
+        view = (templatenxn) {1, t->a, t->b, t->z, t->d, t->dij, t->dkl, t->phi, t->phi_data};
+    }
+    else if (cell == nonlinearnxn)
+    {
+        view = *(const templatenxn*) cell_data;
+    }
+    linear_engine lin;
+    nonlinear_engine nl;
+    const int nonlinear = !kernel && (cell == nonlinear3x3 || cell == nonlinearnxn) &&
+                          create_nonlinear_engine(&nl, &view, &lin, input1, input2);
+
+    /* a compiled nonlinear template is evaluated like a linear one, with its D part in the kernel */
+    const int engine = linear || kernel || nonlinear;
+    cell_engine generic = {cell, cell_data, input1, input2};
+    void (*eval)(matrix, matrix, double, rect, void*) = cell_eval;
+    void *eval_data = &generic;
+    if (engine)
+    {
+        lin = cell == linearnxn || cell == nonlinearnxn
+              ? create_linear_engine_nxn((templatenxn*) cell_data, input1, s)
+              : create_linear_engine((template3x3*) cell_data, input1, s);
+        lin.kernel = kernel;
+        lin.u1 = input1.data;
+        lin.u2 = input2.data;
+        eval = nonlinear ? nonlinear_eval : linear_eval;
+        eval_data = nonlinear ? (void*) &nl : (void*) &lin;
+    }
+
+    integrator in = create_integrator(solver, dt, opt.tol, opt.active_tol, init, s, eval, eval_data, bnd);
+    integrator_set_blocking(&in, opt.block_steps, linear ? &linear_window_ops : NULL);
+
+    compact cmp;
+    if (reduced)
+    {
+        cmp = create_compact(opt.precision, solver, dt, (template3x3*) cell_data, init, input1, s, bnd);
+    }
 
-    for (double t = 0; t<t_end; t += dt)
+    const convergence conv = opt.conv;
+    const int check = conv.eps > 0 || conv.stable_steps > 0;
+    size_t steps = 0,
+           stable = 0;
+    double t = 0;
+    while (t<t_end)
     {
-        bnd(*state, s);
-        #pragma omp parallel for collapse(2)
-        for (size_t x = s; x<state->w-s; ++x)
+        const double t0 = t;
+        if (reduced)
         {
-            for (size_t y = s; y<state->h-s; ++y)
+            start = st ? stats_clock() : 0;
+            steps += compact_step(&cmp, &t);
+            if (st)
+            {
+                stats_phase(st, PHASE_STEP, start);
+            }
+            /* the state is only widened for steps a preview shows */
+            if (update != update_nothing &&
+                (update != update_preview || preview_due((preview*) update_data)))
             {
-                double *xy = state->data + y*state->w + x;
-                const double xy_val = *xy;
-                const double k1 = dt*cell(x, y, *state, input1, input2, t, cell_data);
-                *xy = xy_val + k1/2;
-                const double k2 = dt*cell(x, y, *state, input1, input2, t+dt/2, cell_data);
-                *xy = xy_val + k2/2;
-                const double k3 = dt*cell(x, y, *state, input1, input2, t+dt/2, cell_data);
-                *xy = xy_val + k3;
-                const double k4 = dt*cell(x, y, *state, input1, input2, t+dt, cell_data);
-                *xy = xy_val;
-
-                next_state->data[y*next_state->w + x] = state->data[y*state->w + x] + k1/6 + k2/3 + k3/3 + k4/6;
+                start = st ? stats_clock() : 0;
+                compact_load(&cmp, *state);
+                if (update == update_preview)
+                {
+                    preview_snapshot((preview*) update_data, *state);
+                }
+                else
+                {
+                    update(*state, update_data);
+                }
+                if (st)
+                {
+                    stats_phase(st, PHASE_UPDATE, start);
+                }
             }
         }
-        update(*state, update_data);
-        matrix *tmp = state;
-        state = next_state;
-        next_state = tmp;
-    }
-    
-    #pragma omp parallel for collapse(2)
-    for (size_t x = 0; x<state->w; ++x)
-    {
-        for (size_t y = 0; y<state->h; ++y)
+        else
+        {
+            start = st ? stats_clock() : 0;
+            integrator_bound(&in, *state);
+            if (st)
+            {
+                stats_phase(st, PHASE_BOUND, start);
+                start = stats_clock();
+            }
+            steps += integrator_step(&in, *state, *next_state, &t, t_end);
+            if (st)
+            {
+                stats_phase(st, PHASE_STEP, start);
+                start = stats_clock();
+            }
+            update(*state, update_data);
+            if (st)
+            {
+                stats_phase(st, PHASE_UPDATE, start);
+            }
+            matrix *tmp = state;
+            state = next_state;
+            next_state = tmp;
+        }
+
+        if (in.tiles.nactive == 0)
+        {
+            break;
+        }
+
+        if (check)
         {
-            state->data[y*state->w + x] = phi(state->data[y*state->w + x]);
+            int settled;
+            const double rate = reduced ? compact_rate(&cmp, t - t0, &settled)
+                                        : grid_rate(*next_state, *state, s, t - t0, &settled);
+            stable = settled ? stable+1 : 0;
+            if ((conv.eps > 0 && rate < conv.eps) ||
+                (conv.stable_steps > 0 && stable >= conv.stable_steps))
+            {
+                break;
+            }
         }
     }
 
+    if (reduced)
+    {
+        compact_load(&cmp, *state);
+        free_compact(&cmp);
+    }
+
+    if (info)
+    {
+        info->t = t;
+        info->steps = steps;
+    }
+    if (st)
+    {
+        st->steps += steps;
+    }
+
+    if (nonlinear)
+    {
+        free_nonlinear_engine(&nl);
+    }
+    if (engine)
+    {
+        free_linear_engine(&lin);
+    }
+    free_integrator(&in);
     free_matrix(*next_state);
     free_matrix(input1);
     free_matrix(input2);
@@ -562,6 +970,114 @@ matrix run_cnn(matrix init, matrix input1_, matrix input2_, size_t s,
     return *state;
 }
 
+matrix run_cnn(matrix init, matrix input1, matrix input2, size_t s,
+               double (*cell)(size_t, size_t, matrix, matrix, matrix, double, void*),
+               void *cell_data, void (*bnd)(matrix, size_t), double dt, double t_end, int solver,
+               run_options opt, run_info *info, void (*update)(matrix, void*), void *update_data)
+{
+    matrix state = run_cnn_state(init, input1, input2, s, cell, cell_data, bnd, dt, t_end, solver, opt,
+                                 info, update, update_data);
+
+    #pragma omp parallel for
+    for (size_t y = 0; y<state.h; ++y)
+    {
+        double *row = state.data + y*state.w;
+        #pragma omp simd
+        for (size_t x = 0; x<state.w; ++x)
+        {
+            row[x] = row[x] < -1 ? -1 : (row[x] > 1 ? 1 : row[x]);
+        }
+    }
+
+    return state;
+}
+
+/*
+   Run the same template on n independent images. With at least as many
+   images as threads every image is simulated by a single thread, and the
+   parallel regions inside run_cnn stay inactive; with fewer images they are
+   run one after another, each one using every thread.
+*/
+void run_cnn_batch(size_t n, const matrix *init, const matrix *input1, const matrix *input2, matrix *out,
+                   size_t s, double (*cell)(size_t, size_t, matrix, matrix, matrix, double, void*),
+                   void *cell_data, void (*bnd)(matrix, size_t), double dt, double t_end, int solver,
+                   run_options opt, run_info *info)
+{
+    /*
+       not an if clause: regions nested in an inactive one do not reuse the
+       thread pool, which makes the one-after-another case much slower
+    */
+    if (n >= (size_t) omp_get_max_threads())
+    {
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i<n; ++i)
+        {
+            out[i] = run_cnn(init[i], input1[i], input2[i], s, cell, cell_data, bnd, dt, t_end,
+                             solver, opt, info ? info + i : NULL, update_nothing, NULL);
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i<n; ++i)
+        {
+            out[i] = run_cnn(init[i], input1[i], input2[i], s, cell, cell_data, bnd, dt, t_end,
+                             solver, opt, info ? info + i : NULL, update_nothing, NULL);
+        }
+    }
+}
+
+/*
+   Run a template chain without leaving C. Every plane keeps its boundary
+   between simulations, so results are passed on as they are, and each
+   intermediate result is freed as soon as no later simulation reads it.
+   The planes given by the caller are never freed; the result of the last
+   simulation is returned, or NULLMAT if the chain is empty.
+*/
+matrix run_chain(size_t n, const chain_stage *stages, matrix *planes, size_t nplanes, size_t s,
+                 run_options opt, run_info *info, void (*update)(matrix, void*), void *update_data)
+{
+    if (n == 0)
+    {
+        return NULLMAT;
+    }
+
+    size_t *last = (size_t*) calloc(nplanes, sizeof(size_t));
+    unsigned char *owned = (unsigned char*) calloc(nplanes, 1);
+    for (size_t i = 0; i<n; ++i)
+    {
+        last[stages[i].init] = i;
+        last[stages[i].input1] = i;
+        last[stages[i].input2] = i;
+    }
+
+    for (size_t i = 0; i<n; ++i)
+    {
+        const chain_stage *st = stages + i;
+        fill_bounds(planes[st->init], s, st->fill);
+        fill_bounds(planes[st->input1], s, st->fill);
+        fill_bounds(planes[st->input2], s, st->fill);
+
+        planes[st->output] = run_cnn(planes[st->init], planes[st->input1], planes[st->input2], s,
+                                     st->cell, st->cell_data, st->bnd, st->dt, st->t_end,
+                                     st->solver, opt, info ? info + i : NULL, update, update_data);
+        owned[st->output] = 1;
+
+        for (size_t p = 0; p<nplanes; ++p)
+        {
+            if (owned[p] && last[p] <= i && p != stages[n-1].output)
+            {
+                free_matrix(planes[p]);
+                planes[p] = NULLMAT;
+                owned[p] = 0;
+            }
+        }
+    }
+
+    free(last);
+    free(owned);
+    return planes[stages[n-1].output];
+}
+
 void init_cnn()
 {
     SDL_Init(SDL_INIT_VIDEO);
@@ -572,4 +1088,6 @@ void quit_cnn()
 {
     IMG_Quit();
     SDL_Quit();
+    pool_release();
+    finish_distributed();
 }
@@ -17,10 +17,27 @@
 #include <stdlib.h>
 #include <SDL.h>
 
+#define SOLVER_EULER 0
+#define SOLVER_HEUN 1
+#define SOLVER_RK4 2
+#define SOLVER_RK45 3
+
+#define PRECISION_DOUBLE 0
+#define PRECISION_FLOAT 1
+#define PRECISION_FIXED16 2
+
+/*
+   A w x h plane, row y starting at data + y*stride. A matrix may have a
+   halo around it: halo more cells on every side, in the same storage,
+   which the boundary conditions are written to. Matrices made here are
+   stored contiguously, so their stride is w + 2*halo. The simulator works
+   on whole planes without a halo, whose stride is their width.
+*/
 typedef struct
 {
     size_t w, h;
     double *data;
+    size_t stride, halo;
 } matrix ;
 
 typedef struct
@@ -34,17 +51,123 @@ typedef struct
     void *phi_data;
 } template3x3;
 
+/*
+   A space invariant template of radius r. a, b and d point to (2r+1)^2
+   coefficients each, row by row; the nonlinear d term is the same as for
+   template3x3.
+*/
+typedef struct
+{
+    size_t r;
+    const double *a;
+    const double *b;
+    double z;
+    const double *d;
+    int dij, dkl;
+    double (*phi)(double, void*);
+    void *phi_data;
+} templatenxn;
+
+/*
+   Early termination: the run stops once max |dx/dt| over the grid drops
+   below eps, or once every output has been saturated and unchanged for
+   stable_steps consecutive steps. A zero value disables either criterion.
+*/
+typedef struct
+{
+    double eps;
+    size_t stable_steps;
+} convergence;
+
+/*
+   How a run is integrated, apart from its template, time span and solver:
+   tol is the error tolerance of the adaptive solver, active_tol that of
+   the active tiles (see tile_set), block_steps how many steps are fused
+   into one pass over the grid, precision that of the planes (PRECISION_*),
+   jit whether 3x3 templates are compiled, and conv when the run stops
+   early.
+*/
+typedef struct
+{
+    double tol;
+    double active_tol;
+    size_t block_steps;
+    int precision;
+    int jit;
+    convergence conv;
+} run_options;
+
+typedef struct
+{
+    double t;
+    size_t steps;
+} run_info;
+
+#define PHASE_LOAD 0
+#define PHASE_COPY 1
+#define PHASE_BOUND 2
+#define PHASE_STEP 3
+#define PHASE_UPDATE 4
+#define PHASE_SAVE 5
+#define PHASES 6
+
+/* Threads beyond this many share the counters of the first ones. */
+#define STATS_THREADS 64
+
+/*
+   What a profiled run spent its time on. The phases are converting images
+   to matrices, copying matrices, the boundary conditions of the state,
+   the steps (with the boundaries of their stages), the update callbacks
+   like the animation, and converting matrices to images. cells counts
+   template evaluations of single cells, and thread_seconds and
+   thread_cells show how they were shared by the threads of the parallel
+   regions; threads is the number of threads those had.
+*/
+typedef struct
+{
+    double seconds[PHASES];
+    size_t calls[PHASES];
+    size_t steps, cells;
+    size_t allocations, bytes;
+    size_t threads;
+    double thread_seconds[STATS_THREADS];
+    size_t thread_cells[STATS_THREADS];
+} cnn_stats;
+
+/*
+   One simulation of a template chain. init, input1 and input2 are indices
+   of the planes passed to run_chain, and the result is stored at output.
+   Constant boundaries are filled with fill before the simulation starts.
+*/
+typedef struct
+{
+    double (*cell)(size_t, size_t, matrix, matrix, matrix, double, void*);
+    void *cell_data;
+    void (*bnd)(matrix, size_t);
+    double fill;
+    size_t init, input1, input2, output;
+    double dt, t_end;
+    int solver;
+} chain_stage;
+
 extern const matrix NULLMAT;
+extern const convergence NOCONV;
 
 matrix create_matrix(size_t w, size_t h);
+matrix create_padded_matrix(size_t w, size_t h, size_t s);
+matrix matrix_plane(matrix m);
+matrix matrix_interior(matrix plane, size_t s);
+matrix pad_matrix(matrix m, size_t s);
 matrix copy_matrix(matrix m);
 void free_matrix (matrix m);
 void fill_matrix (matrix m, double val);
 
-matrix img_to_data(SDL_Surface *img);
+matrix img_to_data(SDL_Surface *img, size_t s);
 SDL_Surface *data_to_img(matrix data);
-matrix load_image(const char *file);
-void save_image(SDL_Surface *surf, const char *file);
+matrix load_image(const char *file, size_t s);
+/* Both return 0 and print why if the image can't be saved. */
+int save_image(SDL_Surface *surf, const char *file);
+int save_matrix(matrix m, const char *file);
 matrix expand_matrix(matrix m, size_t s);
 matrix shrink_matrix(matrix m, size_t s);
 void fill_bounds(matrix m, size_t s, double val);
@@ -67,14 +190,38 @@ double nonlin_pw_linear(double val, void *data);
 
 double linear3x3(size_t x, size_t y, matrix state, matrix input1, matrix input2,double t, void *tem);
 double nonlinear3x3(size_t x, size_t y, matrix state, matrix input1, matrix input2,double t, void *tem);
+double linearnxn(size_t x, size_t y, matrix state, matrix input1, matrix input2, double t, void *tem);
+double nonlinearnxn(size_t x, size_t y, matrix state, matrix input1, matrix input2, double t, void *tem);
 
 void update_animate(matrix m, void *data);
 void update_nothing(matrix m, void *data);
 
 matrix run_cnn(matrix init, matrix input1_, matrix input2_, size_t s,
                double (*cell)(size_t, size_t, matrix, matrix, matrix, double, void*),
-               void *cell_data, void (*bnd)(matrix, size_t), double dt, double t_end,
-               void (update)(matrix, void*), void *update_data);
+               void *cell_data, void (*bnd)(matrix, size_t), double dt, double t_end, int solver,
+               run_options opt, run_info *info, void (update)(matrix, void*), void *update_data);
+/* run_cnn without clamping the result to [-1, 1], for runs that are continued later. */
+matrix run_cnn_state(matrix init, matrix input1_, matrix input2_, size_t s,
+                     double (*cell)(size_t, size_t, matrix, matrix, matrix, double, void*),
+                     void *cell_data, void (*bnd)(matrix, size_t), double dt, double t_end, int solver,
+                     run_options opt, run_info *info, void (update)(matrix, void*), void *update_data);
+void run_cnn_batch(size_t n, const matrix *init, const matrix *input1, const matrix *input2, matrix *out,
+                   size_t s, double (*cell)(size_t, size_t, matrix, matrix, matrix, double, void*),
+                   void *cell_data, void (*bnd)(matrix, size_t), double dt, double t_end, int solver,
+                   run_options opt, run_info *info);
+matrix run_chain(size_t n, const chain_stage *stages, matrix *planes, size_t nplanes, size_t s,
+                 run_options opt, run_info *info, void (*update)(matrix, void*), void *update_data);
+
+/*
+   Profile everything the calling thread runs into st, which is cleared
+   first, until profile_into(NULL). Runs that aren't profiled pay for one
+   check of a thread local pointer per phase.
+*/
+void profile_into(cnn_stats *st);
+cnn_stats *profiling();
+double stats_clock();
+void stats_phase(cnn_stats *st, int phase, double start);
+void stats_work(cnn_stats *st, size_t cells, double start);
 
 void init_cnn();
 void quit_cnn();
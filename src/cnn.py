@@ -18,11 +18,17 @@ Exports:
   - Matrix is an n-by-m real matrix.
   - Template is a, uh, CNN template.
   - load_image loads an image file into a Matrix.
+  - Context holds the state of one simulator instance.
   - run runs the CNN simulator with the given input and template.
+  - run_batch runs one template on many images at once.
+  - run_stream runs templates on every frame of a video stream.
+  - run_tiled runs a template on raw images too large for memory.
 '''
 
 from ctypes import *
 import os
+import sys
+import time
 import atexit
 
 CNN = cdll.LoadLibrary(os.curdir + "/libcnn.so.1")
@@ -35,6 +41,13 @@ CNN.count_blacks_right.restype = c_size_t
 CNN.count_blacks_top.restype = c_size_t
 CNN.count_blacks_bottom.restype = c_size_t
 CNN.py_load_image.restype = c_void_p
+CNN.py_create_context.restype = c_void_p
+CNN.py_apply_stream.restype = c_long
+CNN.py_apply_tiled.restype = c_int
+CNN.py_apply_distributed.restype = c_int
+
+_solvers = {"euler": 0, "heun": 1, "rk4": 2, "rk45": 3}
+_precisions = {"double": 0, "float": 1, "fixed16": 2}
 
 class _MatrixRaw (Structure):
     '''
@@ -45,6 +58,9 @@ class _MatrixRaw (Structure):
     Members:
       - w is the number of columns.
       - h is the number of rows.
+      - halo is the number of boundary cells stored around the matrix on
+        every side, which the simulator pads it with.
+      - stride is the distance between the starts of two rows.
     
     Methods:
       - __init__ creates a new matrix with a given width and height.
@@ -52,24 +68,31 @@ class _MatrixRaw (Structure):
       - set changes a specified item.
       - expand expands the matrix by a given amount.
       - shrink shrinks the matrix by a given amount.
+      - padded copies the matrix into storage with a given halo.
       - blacks counts black pixels (ones) in the matrix.
       - to_list converts the matrix into a Python list.
+      - buffer returns a memoryview of the items, without copying them.
+
+    The matrix also has an __array_interface__, so numpy.asarray(m) is an
+    h-by-w array that shares its items with m.
     '''
     _fields_ = [("w", c_size_t),
                 ("h", c_size_t),
-                ("data", POINTER(c_double))]
+                ("data", POINTER(c_double)),
+                ("stride", c_size_t),
+                ("halo", c_size_t)]
 
     def get(self, x, y):
         '''Return the value of the item positioned at the x-th column's y-th row.'''
         if x < 0 or x >= self.w or y < 0 or y >= self.h:
             raise ValueError("coordinate out of bounds")
-        return self.data[y*self.w + x]
+        return self.data[y*self.stride + x]
     
     def set(self, x, y, val):
         '''Set the value of the item positioned at the x-th column's y-th row.'''
         if x < 0 or x >= self.w or y < 0 or y >= self.h:
             raise ValueError("coordinate out of bounds")
-        self.data[y*self.w + x] = c_double(val)
+        self.data[y*self.stride + x] = c_double(val)
 
     def expand(self, s):
         '''Expand the matrix by s rows/columns in all directions and return the new matrix.'''
@@ -80,6 +103,10 @@ class _MatrixRaw (Structure):
         if s > self.w/2:
             raise ValueError("can't shrink matrix to negative size")
         return CNN.shrink_matrix(self, c_size_t(s))
+
+    def padded(self, s):
+        '''Return a copy of the matrix with a halo of s cells, which run uses without copying it again.'''
+        return CNN.pad_matrix(self, c_size_t(s))
     
     def blacks(self, where = "all"):
         '''
@@ -105,12 +132,37 @@ class _MatrixRaw (Structure):
     
     def to_list(self):
         '''Copy the items of the the matrix into a Python list of lists.'''
-        res = []
-        for x in range(0, self.w):
-            res.append([])
-            for y in range(0, self.h):
-                res[-1].append(self.get(x, y))
-        return res    
+        if self.h == 0:
+            return [[] for x in range(0, self.w)]
+        items = self.data[:self.stride*(self.h-1) + self.w]
+        return [items[x::self.stride] for x in range(0, self.w)]
+
+    def buffer(self):
+        '''
+        Return an h-by-w memoryview of the items of the matrix, which shares them with it.
+
+        Memoryviews can't skip the halo at the ends of the rows, so for a
+        matrix with a halo, the view is of its whole storage, halo included:
+        h+2*halo rows of stride items.
+        '''
+        start = cast(self.data, c_void_p).value
+        if start is None:
+            raise ValueError("the matrix has no items")
+        shape = (self.h, self.w)
+        if self.stride != self.w:
+            start -= 8*self.halo*(self.stride + 1)
+            shape = (self.h + 2*self.halo, self.stride)
+        items = (c_double * (shape[0]*shape[1])).from_address(start)
+        items._matrix = self
+        return memoryview(items).cast("B").cast("d", shape)
+
+    @property
+    def __array_interface__(self):
+        return {"version": 3,
+                "shape": (self.h, self.w),
+                "strides": None if self.stride == self.w else (8*self.stride, 8),
+                "typestr": ("<" if sys.byteorder == "little" else ">") + "f8",
+                "data": (cast(self.data, c_void_p).value or 0, False)}
 
 
 class Matrix (_MatrixRaw):
@@ -127,30 +179,128 @@ class Matrix (_MatrixRaw):
       - set changes a specified item.
       - expand expands the matrix by a given amount.
       - shrink shrinks the matrix by a given amount.
+      - padded copies the matrix into storage with a given halo.
       - blacks counts black pixels (ones) in the matrix.
       - to_list converts the matrix into a Python list.
+      - buffer returns a memoryview of the items, without copying them.
+      - wrap makes a matrix of the items of a NumPy array or a buffer.
     '''
-    
-    def __new__(cls, w = 0, h = 0):
-        if w < 0 or h < 0:
+
+    _owner = None
+
+    def __new__(cls, w = 0, h = 0, halo = 0):
+        if w < 0 or h < 0 or halo < 0:
             raise ValueError("dimensions must be positive integers")
-        return CNN.create_matrix(c_size_t(w), c_size_t(h))
+        return CNN.create_padded_matrix(c_size_t(w), c_size_t(h), c_size_t(halo))
     
-    def __init__(self, w = 0, h = 0):
-        '''Initialize a new matrix with w rows and h columns.'''
+    def __init__(self, w = 0, h = 0, halo = 0):
+        '''
+        Initialize a new matrix with w rows and h columns.
+
+        With halo > 0, the matrix is stored with room for that many boundary
+        cells on every side, so run uses it without copying it into a padded
+        plane when the templates need that many (1 for 3-by-3 templates).
+        '''
         self.w = w
         self.h = h
     
     def __del__(self):
-        CNN.free_matrix(self)
+        if self._owner is None:
+            CNN.free_matrix(self)
+
+    @staticmethod
+    def wrap(items, halo = 0):
+        '''
+        Make a matrix of the items of a 2-dimensional array without copying them.
+
+        items can be a NumPy array, or anything else with an
+        __array_interface__ or the buffer protocol, holding C-contiguous,
+        writable float64 values. The matrix shares its items with the array
+        and keeps it alive.
+
+        halo is the number of cells around the edges of the array which
+        only serve as the boundary of the image. The matrix is the inner
+        part of the array, items.shape[1] - 2*halo wide and
+        items.shape[0] - 2*halo high. run and run_batch use the array in
+        place instead of copying it into a padded plane when the halo is as
+        wide as the templates need (1 for 3-by-3 templates), and overwrite
+        the halo cells.
+        '''
+        if hasattr(items, "__array_interface__"):
+            ai = items.__array_interface__
+            shape = ai["shape"]
+            if len(shape) != 2 or ai["typestr"][1:] != "f8" or ai["typestr"][0] == ("<" if sys.byteorder == "big" else ">"):
+                raise ValueError("array must be a 2-dimensional array of native float64 values")
+            if ai.get("strides") not in (None, (8*shape[1], 8)):
+                raise ValueError("array must be C-contiguous")
+            if ai["data"][1]:
+                raise ValueError("array must be writable")
+            address = ai["data"][0]
+        else:
+            view = memoryview(items)
+            shape = view.shape
+            if view.ndim != 2 or view.format != "d" or not view.c_contiguous or view.readonly:
+                raise ValueError("buffer must be a writable, C-contiguous 2-dimensional buffer of doubles")
+            address = addressof(c_char.from_buffer(view.cast("B")))
+
+        if 2*halo > min(shape):
+            raise ValueError("halo is larger than the array")
+        m = Structure.__new__(Matrix)
+        m.w = shape[1] - 2*halo
+        m.h = shape[0] - 2*halo
+        m.stride = shape[1]
+        m.halo = halo
+        m.data = cast(c_void_p(address + 8*halo*(shape[1] + 1)), POINTER(c_double))
+        m._owner = items
+        return m
     
 
 
 CNN.create_matrix.restype = Matrix
+CNN.create_padded_matrix.restype = Matrix
+CNN.pad_matrix.restype = Matrix
 CNN.expand_matrix.restype = Matrix
 CNN.shrink_matrix.restype = Matrix
 CNN.py_load_image.restype = Matrix
-CNN.py_apply_template.restype = Matrix
+CNN.py_apply_chain.restype = Matrix
+
+class _RunInfo (Structure):
+    _fields_ = [("t", c_double),
+                ("steps", c_size_t)]
+
+CNN.py_get_info.restype = _RunInfo
+
+_phases = ["load", "copy", "bound", "step", "update", "save"]
+_stats_threads = 64
+
+class _Stats (Structure):
+    _fields_ = [("seconds", c_double * len(_phases)),
+                ("calls", c_size_t * len(_phases)),
+                ("steps", c_size_t),
+                ("cells", c_size_t),
+                ("allocations", c_size_t),
+                ("bytes", c_size_t),
+                ("threads", c_size_t),
+                ("thread_seconds", c_double * _stats_threads),
+                ("thread_cells", c_size_t * _stats_threads)]
+
+CNN.py_get_stats.restype = _Stats
+
+class Context:
+    '''
+    The state of one simulator instance.
+
+    A context keeps the settings of the simulation running in it and its
+    display window. Contexts are independent of each other, so simulations
+    in different contexts can run on different threads at the same time.
+    '''
+
+    def __init__(self):
+        self._ctx = c_void_p(CNN.py_create_context())
+        self._cells = []
+
+    def __del__(self):
+        CNN.py_free_context(self._ctx)
 
 class _TemplateRaw (Structure):
     _fields_ = [("a", c_double * 9),
@@ -162,15 +312,33 @@ class _TemplateRaw (Structure):
                 ("phi", c_void_p),
                 ("phi_data", c_void_p)]
 
+class _TemplateNxNRaw (Structure):
+    _fields_ = [("r", c_size_t),
+                ("a", POINTER(c_double)),
+                ("b", POINTER(c_double)),
+                ("z", c_double),
+                ("d", POINTER(c_double)),
+                ("dij", c_int),
+                ("dkl", c_int),
+                ("phi", c_void_p),
+                ("phi_data", c_void_p)]
+
 class Template:
     '''
-    Encapsulates a place and time invariant 3-by-3 CNN template.
+    Encapsulates a place and time invariant CNN template.
     
     Methods:
       - __init__: initialize a new template with given coefficients.
     '''
 
-    def _init_array_(param):
+    def _radius_(param):
+        k = round(len(param)**0.5)
+        if len(param) > 9 and k*k == len(param) and k % 2 == 1:
+            return k//2
+        return 1
+
+    def _init_array_(param, r = 1):
+        k0 = 3
         if len(param) == 9:
             field = param
         elif len(param) == 1:
@@ -184,14 +352,20 @@ class Template:
             e = param[1]
             c = param[2]
             field = [c, e, c, e, m, e, c, e, c]
+        elif Template._radius_(param) > 1:
+            field = param
+            k0 = 2*Template._radius_(param) + 1
         else:
-            raise ValueError("list must be precisely 9, 3, 2 or 1 long")
-        res = (c_double * 9)()
-        for i in range(0,9):
-            res[i] = field[i]
+            raise ValueError("list must be precisely 9, 3, 2 or 1 long, or (2r+1)^2 long")
+        k = 2*r + 1
+        off = (k - k0)//2
+        res = (c_double * (k*k))()
+        for j in range(0, k0):
+            for i in range(0, k0):
+                res[(j+off)*k + i+off] = field[j*k0 + i]
         return res
 
-    def __init__(self, a = [0]*9, b = [0]*9, z = 0, bound = 0, dt = 0.1, t_end = 10.0, d = [0]*9, dfunc = "std", dtype = "u1-x"):
+    def __init__(self, a = [0]*9, b = [0]*9, z = 0, bound = 0, dt = 0.1, t_end = 10.0, d = [0]*9, dfunc = "std", dtype = "u1-x", solver = "rk4"):
         '''
         Initialize a new template with given settings.
 
@@ -220,6 +394,15 @@ class Template:
         0 1 0
         0 0 0
 
+        Larger templates of radius r are given as (2r+1)^2-long lists, row by
+        row, like the 9-long form. a, b and d may have different sizes; the
+        smaller ones are padded with zeros around their center. These run in
+        native code just like 3-by-3 templates, so they are the fast way to
+        define templates that don't fit in 3-by-3. Separable templates, like
+        a Gaussian blur, and sums of a few of them cost about 2(2r+1) per cell
+        instead of (2r+1)^2, and a wide b is applied with FFT, so its cost
+        hardly grows with r.
+
         z is the bias.
 
         bound is the boundary condition. It can either be a numeric value between
@@ -229,6 +412,9 @@ class Template:
         dt and t_end tell the recommended time step and time interval for this
         template. These values may be overwritten in the actual simulation.
 
+        solver is the recommended ODE solver, one of "euler", "heun", "rk4" or
+        "rk45". It may be overwritten in the actual simulation as well.
+
         Nonlinear templates are supported through the d, dfunc and dtype parameters.
         d is the coefficient matrix, dfunc is the nonlinearity, specified as
         "sd" for the standard CNN nonlinearity, "sign" for the sign function, "abs"
@@ -236,9 +422,10 @@ class Template:
         constant function. For piecewise nonlinearities, you should avoid manual
         initialization and use the pw_const or pw_lin function instead.
         '''
-        ta = Template._init_array_(a)
-        tb = Template._init_array_(b)
-        td = Template._init_array_(d)
+        r = max(Template._radius_(a), Template._radius_(b), Template._radius_(d))
+        ta = Template._init_array_(a, r)
+        tb = Template._init_array_(b, r)
+        td = Template._init_array_(d, r)
 
         nl_func = CNN.nonlin_standard
         nl_data = None
@@ -256,7 +443,7 @@ class Template:
             if dfunc[0] == "const":
                 nl_func = CNN.nonlin_pw_constant
             elif dfunc[0] == "lin":
-                nl_func == CNN.nonlin_pw_linear
+                nl_func = CNN.nonlin_pw_linear
         else:
             raise TypeError("dfunc must be a string or a list")
         
@@ -265,10 +452,16 @@ class Template:
         dkl = ops.index(dtype.split("-")[0])
         
 
-        self.tem = _TemplateRaw(ta, tb, z, td, dij, dkl, cast(nl_func, c_void_p), cast(nl_data, c_void_p))
+        if r == 1:
+            self.tem = _TemplateRaw(ta, tb, z, td, dij, dkl, cast(nl_func, c_void_p), cast(nl_data, c_void_p))
+        else:
+            self.tem = _TemplateNxNRaw(r, ta, tb, z, td, dij, dkl, cast(nl_func, c_void_p), cast(nl_data, c_void_p))
+        self.radius = r
+        self.nonlinear = any(td)
         self.bound = bound
         self.dt = dt
         self.t_end = t_end
+        self.solver = solver
 
 def pw_const(*args):
     '''
@@ -310,60 +503,50 @@ def pw_lin(*args):
         prev_y = parts[i+1]
     return res
 
-def load_image(path):
+def load_image(path, halo = 1):
     '''
     Load the image file at path into a Matrix object.
 
+    The image is stored with room for halo boundary cells on every side,
+    the way Matrix does it, so run uses it without copying it when its
+    templates need no more (1 for 3-by-3 templates).
+
     Supports JPG, PNG and BMP formats.
     '''
-    return CNN.py_load_image(path.encode())
+    return CNN.py_load_image(path.encode(), c_size_t(halo))
 
 def save_image(mat, path):
     '''
-    Save mat as grayscale PNG into path.
+    Save mat as an 8 bit grayscale PNG into path.
     '''
-    CNN.save_image(CNN.data_to_img(mat), path.encode())
+    if not CNN.save_matrix(mat, path.encode()):
+        raise IOError("can't save " + path)
 
-def __set_template(tem, init, input1, input2):
+_cell_func = CFUNCTYPE(c_double, c_size_t, c_size_t, _MatrixRaw, _MatrixRaw, _MatrixRaw, c_double, c_void_p)
+_bounds = {"zeroflux": 2.0, "periodic": 3.0}
+
+def __set_template(ctx, tem):
     bound = None
-    cell_func = CFUNCTYPE(c_double, c_size_t, c_size_t, _MatrixRaw, _MatrixRaw, _MatrixRaw, c_double, c_void_p)
     s = 1
     if type(tem) is tuple:
-        f = cell_func(tem[0])
+        ctx._cells = [_cell_func(tem[0])]
         bound = tem[1]
         if len(tem) >= 3:
             s = c_size_t(tem[2])
-        CNN.py_set_template_custom(f, s)
+        CNN.py_set_template_custom(ctx._ctx, ctx._cells[0], s)
     elif type(tem) is Template:
         bound = tem.bound
-        CNN.py_set_template3x3(tem.tem)
-    
-    if type(bound) is float:
-        CNN.py_set_boundary(c_double(bound))
-        CNN.fill_bounds(init, c_size_t(s), c_double(bound))
-        CNN.fill_bounds(input1, c_size_t(s), c_double(bound))
-        CNN.fill_bounds(input2, c_size_t(s), c_double(bound))
-    elif bound == "zeroflux":
-        CNN.py_set_boundary(c_double(2.0))
-    elif bound == "periodic":
-        CNN.py_set_boundary(c_double(3.0))
-
-def __run_single(init, input, templ, dt = None, t_end = None, anim = False, block = False, close = True):
-    input1 = input
-    input2 = input
-    if type(input) is tuple:
-        input1 = input[0]
-        input2 = input[1]
+        if tem.radius == 1:
+            CNN.py_set_template3x3(ctx._ctx, tem.tem)
+        else:
+            CNN.py_set_templatenxn(ctx._ctx, tem.tem)
     
-    if input1 is None:
-        input1 = init
-    if input2 is None:
-        input2 = init
-
-    init = init.expand(1)
-    input1 = input1.expand(1)
-    input2 = input2.expand(1)
+    if type(bound) in (int, float):
+        CNN.py_set_boundary(ctx._ctx, c_double(bound))
+    elif bound in _bounds:
+        CNN.py_set_boundary(ctx._ctx, c_double(_bounds[bound]))
 
+def __defaults(templ, dt, t_end, solver):
     if dt is None:
         if type(templ) is Template:
             dt = templ.dt
@@ -374,22 +557,166 @@ def __run_single(init, input, templ, dt = None, t_end = None, anim = False, bloc
             t_end = templ.t_end
         else:
             t_end = 10.0
+    if solver is None:
+        if type(templ) is Template:
+            solver = templ.solver
+        else:
+            solver = "rk4"
+    if solver not in _solvers:
+        raise ValueError("solver must be one of 'euler', 'heun', 'rk4' or 'rk45'")
+    return dt, t_end, solver
+
+def __configure(ctx, solver, tol, eps, stable_steps, active_tol, block_steps, precision, jit):
+    if precision not in _precisions:
+        raise ValueError("precision must be one of 'double', 'float' or 'fixed16'")
+
+    CNN.py_set_solver(ctx._ctx, _solvers[solver], c_double(tol))
+    CNN.py_set_convergence(ctx._ctx, c_double(eps), c_size_t(stable_steps))
+    CNN.py_set_active_tolerance(ctx._ctx, c_double(active_tol))
+    CNN.py_set_block_steps(ctx._ctx, c_size_t(block_steps))
+    CNN.py_set_precision(ctx._ctx, _precisions[precision])
+    CNN.py_set_jit(ctx._ctx, c_int(1 if jit else 0))
+
+class _ChainStage (Structure):
+    _fields_ = [("cell", c_void_p),
+                ("cell_data", c_void_p),
+                ("bnd", c_void_p),
+                ("fill", c_double),
+                ("init", c_size_t),
+                ("input1", c_size_t),
+                ("input2", c_size_t),
+                ("output", c_size_t),
+                ("dt", c_double),
+                ("t_end", c_double),
+                ("solver", c_int)]
+
+def __chain_stage(ctx, tem, dt, t_end, solver):
+    stage = _ChainStage()
+    bound = None
+    if type(tem) is tuple:
+        ctx._cells.append(_cell_func(tem[0]))
+        stage.cell = cast(ctx._cells[-1], c_void_p)
+        bound = tem[1]
+    elif type(tem) is Template:
+        if tem.radius == 1:
+            stage.cell = cast(CNN.nonlinear3x3 if tem.nonlinear else CNN.linear3x3, c_void_p)
+        else:
+            stage.cell = cast(CNN.nonlinearnxn if tem.nonlinear else CNN.linearnxn, c_void_p)
+        stage.cell_data = cast(pointer(tem.tem), c_void_p)
+        bound = tem.bound
+
+    if type(bound) in (int, float):
+        stage.bnd = cast(CNN.bound_constant, c_void_p)
+        stage.fill = bound
+    elif bound in _bounds:
+        stage.bnd = cast(CNN.bound_zeroflux if bound == "zeroflux" else CNN.bound_periodic, c_void_p)
+        stage.fill = _bounds[bound]
+    else:
+        raise ValueError("bound must be a number, 'zeroflux' or 'periodic'")
+
+    stage.dt = dt
+    stage.t_end = t_end
+    stage.solver = _solvers[solver]
+    return stage
+
+def __chain(ctx, init, input, templ, dt, t_end, solver, stream):
+    '''
+    Wire up the simulations of a chain, the way run describes it. With
+    stream set, plane 0 is left for the frames of a stream, which init and
+    input refer to as 0. Returns the stages, the planes they start from, the
+    halo the planes have and the solver of the last stage.
+    '''
+    tem_list = templ
+    if type(templ) is not list:
+        tem_list = [templ]
+    if len(tem_list) == 0:
+        raise ValueError("the chain needs at least one template")
+    init_list = init
+    if type(init) is not list:
+        init_list = [init] + list(range(1, len(tem_list)))
+    input_list = input
+    if type(input) is not list:
+        input_list = [input]*len(tem_list)
+    dt_list = dt
+    if type(dt) is not list:
+        dt_list = [dt]*len(tem_list)
+    t_end_list = t_end
+    if type(t_end) is not list:
+        t_end_list = [t_end]*len(tem_list)
+    solver_list = solver
+    if type(solver) is not list:
+        solver_list = [solver]*len(tem_list)
+
+    ctx._cells = []
+
+    # the planes are padded for the largest template of the chain
+    def radius(tem):
+        if type(tem) is Template:
+            return tem.radius
+        return tem[2] if len(tem) > 2 else 1
+    pad = max(radius(tem) for tem in tem_list)
+
+    # every image the chain starts from is padded once, unless it has the
+    # right halo already; the results of the simulations go into the slots
+    # after them and are referred to by -N
+    ids = {}
+    planes = [_MatrixRaw()] if stream else []
+    def external(x):
+        key = x if type(x) is str else id(x)
+        if key not in ids:
+            ids[key] = len(planes)
+            m = load_image(x, pad) if type(x) is str else x
+            if m.halo == pad and m.stride == m.w + 2*pad:
+                planes.append(m)
+            else:
+                planes.append(m.padded(pad))
+        return ids[key]
+
+    n = len(tem_list)
+    first = 0 if stream else external(init_list[0])
+    def source(x, i, default):
+        if x is None:
+            return default
+        if type(x) is int:
+            if x > i:
+                raise ValueError("simulation %d can only use the results of earlier simulations" % (i+1))
+            return first if x == 0 else -x
+        return external(x)
+
+    wiring = []
+    for i in range(n):
+        x = source(init_list[i], i, None)
+        inp = input_list[i]
+        if type(inp) is tuple:
+            wiring.append((x, source(inp[0], i, x), source(inp[1], i, x)))
+        else:
+            u = source(inp, i, x)
+            wiring.append((x, u, u))
 
-    __set_template(templ, init, input1, input2)
-
-    CNN.py_set_init(init)
-    CNN.py_set_input1(input1)
-    CNN.py_set_input2(input2)
-    anim_flags = 0
-    if anim:
-        anim_flags += 1
-    if block:
-        anim_flags += 2
-    if close:
-        anim_flags += 4
-    return CNN.py_apply_template(c_double(dt), c_double(t_end), anim_flags).shrink(1)
-
-def run(init, input, templ, dt = None, t_end = None, anim = False):
+    n_ext = len(planes)
+    slot = lambda r: r if r >= 0 else n_ext - r - 1
+    stages = (_ChainStage * n)()
+    for i in range(n):
+        dt_i, t_end_i, solver_i = __defaults(tem_list[i], dt_list[i], t_end_list[i], solver_list[i])
+        stages[i] = __chain_stage(ctx, tem_list[i], dt_i, t_end_i, solver_i)
+        stages[i].init, stages[i].input1, stages[i].input2 = [slot(r) for r in wiring[i]]
+        stages[i].output = n_ext + i
+    return stages, planes, pad, solver_i
+
+def __profile(ctx, seconds):
+    st = CNN.py_get_stats(ctx._ctx)
+    n = max(st.threads, 1)
+    mean = sum(st.thread_seconds[:n])/n
+    return {"seconds": seconds,
+            "phases": dict((name, {"seconds": st.seconds[i], "calls": st.calls[i]}) for i, name in enumerate(_phases)),
+            "steps": st.steps,
+            "cells": st.cells,
+            "allocations": st.allocations,
+            "bytes": st.bytes,
+            "threads": [{"seconds": st.thread_seconds[i], "cells": st.thread_cells[i]} for i in range(n)],
+            "imbalance": max(st.thread_seconds[:n])/mean if mean > 0 else 1.0}
+
+def run(init, input, templ, dt = None, t_end = None, anim = False, solver = None, tol = 1e-3, eps = 0, stable_steps = 0, active_tol = 0, block_steps = 1, precision = "double", jit = False, report = False, profile = False, anim_every = 1, anim_fps = 30, context = None):
     '''
     Run the CNN simulator and return the output matrix.
 
@@ -420,57 +747,380 @@ def run(init, input, templ, dt = None, t_end = None, anim = False):
     set to None, the default values provided by the template will be used.
 
     anim tells whether a visual display of the animation should be shown.
+    The window is drawn by a thread of its own, at most anim_fps times a
+    second, from snapshots of every anim_every-th step that the simulation
+    takes only when a frame is due, so the animation barely slows it down.
+    Steps in between are never shown.
+
+    solver selects the ODE solver: "euler" (forward Euler), "heun" (Heun's
+    method), "rk4" (classic fixed step Runge-Kutta) or "rk45" (Dormand-Prince
+    with adaptive step size). Euler and Heun need one and two template
+    evaluations per step instead of four, which is usually enough for
+    templates with binary output. With "rk45", dt is only the initial step
+    and tol is the relative and absolute error allowed per step. When set
+    to None, the solver recommended by the template is used.
+
+    The simulation may stop before t_end once the network has converged.
+    When eps is positive, it stops as soon as no cell changes faster than
+    eps per unit time. When stable_steps is positive, it stops once every
+    output has been saturated and unchanged for that many steps.
+
+    When active_tol is positive, the grid is processed in tiles and only the
+    tiles that moved by more than active_tol during the previous step, or
+    are next to such a tile, are integrated. The rest of the grid is frozen.
+    For templates where only a thin front moves, like CONN or the CCD
+    templates, this makes the cost of a step proportional to the front
+    instead of the whole image. When no tile moves anymore, the simulation
+    stops.
+
+    block_steps > 1 lets linear templates advance each part of the image that
+    many steps at once while it is in cache, at the cost of recomputing a
+    margin around it. Animation frames and the convergence checks then only
+    happen every block_steps steps. It has no effect with the "rk45" solver,
+    with active_tol or with templates that are not linear.
+
+    precision selects how linear templates store the state: "double",
+    "float" or "fixed16" (16 bit fixed point). The reduced formats move a
+    half or a quarter of the memory per step. Float results typically agree
+    with double to about 1e-6 and fixed16 results to a few 1e-3, but
+    templates that amplify small differences, like AVG or HL3, may settle
+    differently. They are used with the fixed step solvers and the built-in
+    boundary conditions, when active_tol and block_steps are not set;
+    otherwise the state is kept in double precision.
+
+    When jit is True, 3-by-3 templates evaluated in double precision are
+    compiled at run time into kernels with their coefficients and
+    nonlinearity built in, skipping zero coefficients. This needs a C
+    compiler (the CC environment variable, or cc); the compiled kernels are
+    cached in CNN_JIT_DIR, or ~/.cache/pycnn by default, and reused by later
+    runs. Templates the compiler can't handle are run as usual.
+
+    When report is True, a (matrix, reports) tuple is returned instead of
+    just the output matrix. reports holds one dict per simulation with the
+    time at which it stopped ("t") and the number of steps taken ("steps").
+
+    When profile is True, the run is timed and a dict telling where the time
+    went is returned as an extra last item, after the matrix and the
+    reports. It holds:
+      seconds - the wall clock time of the whole call
+      phases - "seconds" and "calls" for each phase: "load" (converting
+               images to matrices), "copy" (copying matrices), "bound"
+               (boundary conditions), "step" (the integration steps),
+               "update" (the animation) and "save" (converting matrices to
+               images)
+      steps, cells - the steps taken by all simulations and the number of
+                     cells evaluated by them
+      allocations, bytes - the matrices allocated and their size
+      threads - "seconds" and "cells" evaluated by each thread
+      imbalance - the busiest thread's time over the mean, 1 when the work
+                  is shared evenly
+    Profiling costs a few timer reads per step and per tile of the grid.
+
+    context is the Context to run the simulation in. When it is None, a new
+    context is used for each call, so separate calls to run may come from
+    different threads.
 
     It's also possible to run a chain of templates with just one function call.
     To do this, you need to pass a list of templates as the templ argument. When
-    calling the function like this, all other arguments (except for anim) may be
-    lists as well, providing different parameters for subsequent simulations or
-    they can be single values. When dt, t_end or input is a single value, that
-    value will be used for all simulations. When init is a single value, that
-    value will be used for the first simulation and all subsequent simulations
-    will use the output of the previous simulation as their initial state. When
-    providing init or input as a list, the list items can either be Matrix
-    objects or strings, which will be handled as described above, or integer
-    values. For each value N, the output matrix of the N-th simulation will be
-    substituted.
+    calling the function like this, all other arguments (except for anim, tol,
+    eps, stable_steps, active_tol, block_steps, precision, jit, report and
+    context)
+    may be lists as well, providing different parameters for subsequent
+    simulations or they can be single values. When dt, t_end, solver or input
+    is a single value, that value will be used for all simulations. When init
+    is a single value, that value will be used for the first simulation and all
+    subsequent simulations will use the output of the previous simulation as
+    their initial state. When providing init or input as a list, the list items
+    can either be Matrix objects or strings, which will be handled as described
+    above, or integer values. For each value N, the output matrix of the N-th
+    simulation will be substituted.
 
     Example:
       # Call avg on image.jpg, then call edge on the resulting image, using the
       # output of the first call as input.
       cnn.run("image.jpg", [None, 1], [avg, edge], anim = True)
     '''
-    tem_list = templ
-    if type(templ) is not list:
-        tem_list = [templ]
-    init_list = init
-    if type(init) is not list:
-        init_list = [init] + list(range(1, len(tem_list)))
-    input_list = input
-    if type(input) is not list:
-        input_list = [input]*len(tem_list)
-    result_list = None
-    block_list = [False]*(len(tem_list)-1) + [True]
-    dt_list = dt
-    if type(dt) is not list:
-        dt_list = [dt]*len(tem_list)
-    t_end_list = t_end
-    if type(t_end) is not list:
-        t_end_list = [t_end]*len(tem_list)
+    ctx = context
+    if ctx is None:
+        ctx = Context()
+    start = time.perf_counter()
+    if profile:
+        CNN.py_profile(ctx._ctx, 1)
+    try:
+        stages, planes, pad, last_solver = __chain(ctx, init, input, templ, dt, t_end, solver, False)
+        __configure(ctx, last_solver, tol, eps, stable_steps, active_tol, block_steps, precision, jit)
+        n = len(stages)
+        n_ext = len(planes)
+
+        info = (_RunInfo * n)()
+        anim_flags = 7 if anim else 0
+        CNN.py_set_preview(ctx._ctx, c_size_t(anim_every), c_double(anim_fps))
+        res = CNN.py_apply_chain(ctx._ctx, c_size_t(n), stages, (_MatrixRaw * (n_ext + n))(*planes),
+                                 c_size_t(n_ext + n), c_size_t(pad), info, anim_flags)
+    finally:
+        if profile:
+            CNN.py_profile(ctx._ctx, 0)
+
+    ret = [res]
+    if report:
+        ret.append([{"t": i.t, "steps": i.steps} for i in info])
+    if profile:
+        ret.append(__profile(ctx, time.perf_counter() - start))
+    return tuple(ret) if len(ret) > 1 else res
+
+def run_batch(inits, input, templ, dt = None, t_end = None, solver = None, tol = 1e-3, eps = 0, stable_steps = 0, active_tol = 0, block_steps = 1, precision = "double", jit = False, report = False, context = None):
+    '''
+    Run the same template on many images with one native call and return
+    the list of output matrices.
+
+    inits is a list of initial states. Its items can be Matrix objects or
+    strings, which are loaded as images like in run. input is None, when
+    every image is its own input, a list of input matrices of the same
+    length, or a two-tuple of such lists for templates with two input
+    layers. templ must be a single template. The other arguments mean the
+    same as for run, and with report = True a (matrices, reports) tuple is
+    returned with one report per image.
 
+    When there are at least as many images as cores, every image is
+    simulated by a single core, so many small images keep all cores busy
+    without paying for a parallel region per image and step. Otherwise the
+    images are run one after another, each one using all cores.
+    '''
+    ctx = context
+    if ctx is None:
+        ctx = Context()
+
+    # images are padded in C, unless they have the right halo already
+    pad = templ.radius if type(templ) is Template else (templ[2] if len(templ) > 2 else 1)
     def get_matrix(x):
-        if type(x) is int:
-            return result_list[x]
-        elif type(x) is str:
-            return load_image(x)
-        else:
-            return x
-    
-    result_list = [get_matrix(init_list[0])]
-    for i in zip(init_list, input_list, tem_list, dt_list, t_end_list, block_list):
-        result_list.append(__run_single(get_matrix(i[0]), get_matrix(i[1]), i[2],  i[3], i[4], anim = anim, close = i[5], block = i[5]))
-    
-    return result_list[-1]
+        if type(x) is str:
+            return load_image(x, pad)
+        return x
+
+    n = len(inits)
+    mats = [get_matrix(m) for m in inits]
+    input1 = input
+    input2 = input
+    if type(input) is tuple:
+        input1 = input[0]
+        input2 = input[1]
+    input1 = mats if input1 is None else [get_matrix(m) for m in input1]
+    input2 = mats if input2 is None else [get_matrix(m) for m in input2]
+    if len(input1) != n or len(input2) != n:
+        raise ValueError("there must be as many inputs as initial states")
+
+    dt, t_end, solver = __defaults(templ, dt, t_end, solver)
+    __set_template(ctx, templ)
+    __configure(ctx, solver, tol, eps, stable_steps, active_tol, block_steps, precision, jit)
+
+    planes = _MatrixRaw * n
+    out = planes()
+    info = (_RunInfo * n)()
+    CNN.py_apply_template_batch(ctx._ctx, c_size_t(n), planes(*mats), planes(*input1), planes(*input2),
+                                out, info, c_double(dt), c_double(t_end))
+
+    # only the headers are copied; the results own the items
+    res = []
+    for m in out:
+        r = Structure.__new__(Matrix)
+        memmove(addressof(r), addressof(m), sizeof(_MatrixRaw))
+        res.append(r)
+    if report:
+        return res, [{"t": i.t, "steps": i.steps} for i in info]
+    return res
+
+_stream_formats = {"raw": 0, "y4m": 1, "images": 2}
+
+def _stream_format(path, size, default):
+    if "%" in path:
+        return "images"
+    if path.endswith(".y4m"):
+        return "y4m"
+    if path == "-" and default is not None:
+        return default
+    return "raw" if size is not None else "y4m"
+
+def run_stream(source, sink, templ, init = None, input = None, dt = None, t_end = None, solver = None, size = None, warm = False, tol = 1e-3, eps = 0, stable_steps = 0, active_tol = 0, block_steps = 1, precision = "double", jit = False, report = False, context = None):
+    '''
+    Run a template, or a chain of templates, on every frame of a video
+    stream or image sequence and write the results to another one. Return
+    the number of frames.
+
+    source and sink are paths, or "-" for the standard input and output.
+    A path with a % in it is a sequence of images, named by a printf
+    pattern with the frame number like "frames/%04d.png", numbered from 0
+    or 1, with any other % written as %%; the results are saved as 8 bit
+    grayscale PNGs, with the same grey levels as raw and Y4M frames get.
+    Otherwise it is a Y4M stream, of which only the luma is used, or with
+    size = (width, height) given a raw stream of 8 bit grey frames. A sink
+    that is "-" gets the format of the source, and any other sink without a
+    % or a .y4m ending is raw when size is given.
+
+    templ, init, input, dt, t_end and solver work as for run, with the
+    frame taking the place of the image the chain starts from: it is the
+    initial state of the first simulation and, with input = None, its
+    input, and init and input lists refer to it as 0. They may also hold
+    Matrix objects or image paths for planes that are the same for every
+    frame. The other arguments mean the same as for run.
+
+    Frames are decoded and encoded on threads of their own while the
+    previous and the next frames are simulated, and the buffers are reused
+    from frame to frame. With warm = True the result of each frame is the
+    initial state of the first simulation for the next one, while the
+    frame stays its input. Together with eps or stable_steps this lets
+    slowly changing video converge in fewer steps.
+
+    With report = True a (frames, reports) tuple is returned, with one dict
+    per simulation of the chain holding the number of steps it took over
+    all frames ("steps") and its stop time for the last frame ("t").
+    '''
+    ctx = context
+    if ctx is None:
+        ctx = Context()
+    if init is None:
+        init = 0
+    stages, planes, pad, last_solver = __chain(ctx, init, input, templ, dt, t_end, solver, True)
+    __configure(ctx, last_solver, tol, eps, stable_steps, active_tol, block_steps, precision, jit)
+    n = len(stages)
+    n_ext = len(planes)
+
+    # the result of the previous frame goes into the slot after the results
+    warm_slot = n_ext + n
+    if warm:
+        stages[0].init = warm_slot
+
+    in_format = _stream_format(source, size, None)
+    out_format = _stream_format(sink, size, in_format if in_format != "images" else None)
+    w, h = size if size is not None else (0, 0)
+    info = (_RunInfo * n)()
+    frames = CNN.py_apply_stream(ctx._ctx, c_size_t(n), stages, (_MatrixRaw * (warm_slot + 1))(*planes),
+                                 c_size_t(warm_slot + 1), c_size_t(0), c_size_t(warm_slot if warm else warm_slot + 1),
+                                 c_size_t(pad), source.encode(), _stream_formats[in_format], c_size_t(w), c_size_t(h),
+                                 sink.encode(), _stream_formats[out_format], info)
+    if frames < 0:
+        raise IOError("can't read or write the streams")
+
+    if report:
+        return frames, [{"t": i.t, "steps": i.steps} for i in info]
+    return frames
+
+
+_samples = {"u8": 0, "f64": 1}
+
+def run_tiled(source, sink, templ, size, input = None, dt = None, t_end = None, solver = None, sample = "u8", out_sample = None, tile = 1024, pass_steps = 0, scratch = None, tol = 1e-3, active_tol = 0, block_steps = 1, precision = "double", jit = False, report = False, context = None):
+    '''
+    Run a template on an image stored in a raw file and write the result to
+    another one, without reading either into memory. This is meant for
+    images like gigapixel mosaics, which don't fit into memory as doubles.
+
+    source is the initial state and, with input = None, the input. input may
+    be another raw file, or a two-tuple of them for templates with two input
+    layers. size is the (width, height) of the images. sample is the format
+    of the input files, "u8" for 8 bit grey levels like raw streams or "f64"
+    for native doubles in the range of the state, and out_sample that of
+    sink, the format of the input by default.
+
+    The files are mapped into memory and the image is simulated in tiles of
+    tile-by-tile cells. Each tile is simulated with a margin around it that
+    is wide enough for no cell outside the image to reach the tile, so the
+    result matches that of run. To keep the margins small, the run is split
+    into passes of pass_steps steps, or as many as fit into a margin of an
+    eighth of a tile when it is 0; the state between passes is kept in
+    scratch files in the scratch directory, which is that of sink by default.
 
+    The fixed step solvers are supported. t_end and the number of steps are
+    the same as for run, but the time seen by cell functions starts from 0
+    again in every pass, and runs don't stop early; eps and stable_steps are
+    not supported. The other arguments mean the same as for run. With
+    report = True a dict like the reports of run is returned.
+    '''
+    ctx = context
+    if ctx is None:
+        ctx = Context()
+    if out_sample is None:
+        out_sample = sample
+    if sample not in _samples or out_sample not in _samples:
+        raise ValueError("sample must be 'u8' or 'f64'")
+    if scratch is None:
+        scratch = os.path.dirname(os.path.abspath(sink))
+
+    input1 = input
+    input2 = input
+    if type(input) is tuple:
+        input1, input2 = input
+    path = lambda x: x.encode() if x is not None else None
+
+    dt, t_end, solver = __defaults(templ, dt, t_end, solver)
+    __set_template(ctx, templ)
+    __configure(ctx, solver, tol, 0, 0, active_tol, block_steps, precision, jit)
+
+    w, h = size
+    ok = CNN.py_apply_tiled(ctx._ctx, source.encode(), path(input1), path(input2), _samples[sample],
+                            c_size_t(w), c_size_t(h), sink.encode(), _samples[out_sample], scratch.encode(),
+                            c_double(dt), c_double(t_end), c_size_t(tile), c_size_t(pass_steps))
+    if not ok:
+        raise IOError("can't run the template on the files")
+
+    if report:
+        info = CNN.py_get_info(ctx._ctx)
+        return {"t": info.t, "steps": info.steps}
+
+def run_distributed(source, sink, templ, size, input = None, dt = None, t_end = None, solver = None, sample = "u8", out_sample = None, tol = 1e-3, jit = False, report = False, context = None):
+    '''
+    Run a template on an image stored in a raw file, split between the
+    processes of an MPI job, like in
+
+        mpirun -np 4 python3 script.py
+
+    with the library built by make mpi. Every process has to call it with
+    the same arguments. The image is split into a grid of blocks, one per
+    process, and every process reads only its block from the files, which
+    all of them must be able to open. The halo of the blocks is exchanged
+    with the neighbors before every stage, while the cells that don't need
+    it are evaluated, and the boundary is applied only on the edges of the
+    image, so the result matches that of run.
+
+    The result is written into sink, a raw file like for run_tiled, or, with
+    sink = None, gathered into a Matrix returned on rank 0; the other ranks
+    return None. source, input, size, sample and out_sample mean the same as
+    for run_tiled. Only the built-in boundaries and the fixed step solvers
+    are supported, and runs don't stop early. The other arguments mean the
+    same as for run. With report = True a dict like the reports of run is
+    returned too.
+    '''
+    ctx = context
+    if ctx is None:
+        ctx = Context()
+    if out_sample is None:
+        out_sample = sample
+    if sample not in _samples or out_sample not in _samples:
+        raise ValueError("sample must be 'u8' or 'f64'")
+    rank = CNN.distributed_rank()
+    if rank < 0:
+        raise RuntimeError("the library was built without MPI, see make mpi")
+
+    input1 = input
+    input2 = input
+    if type(input) is tuple:
+        input1, input2 = input
+    path = lambda x: x.encode() if x is not None else None
+
+    dt, t_end, solver = __defaults(templ, dt, t_end, solver)
+    __set_template(ctx, templ)
+    __configure(ctx, solver, tol, 0, 0, 0, 1, "double", jit)
+
+    w, h = size
+    res = Matrix(w, h) if sink is None and rank == 0 else None
+    ok = CNN.py_apply_distributed(ctx._ctx, source.encode(), path(input1), path(input2), _samples[sample],
+                                  c_size_t(w), c_size_t(h), path(sink), _samples[out_sample],
+                                  byref(res) if res is not None else None, c_double(dt), c_double(t_end))
+    if not ok:
+        raise IOError("can't run the template on the files")
+
+    if report:
+        info = CNN.py_get_info(ctx._ctx)
+        return res, {"t": info.t, "steps": info.steps}
+    return res
 
 AVG = Template([2, 1, 0])
 EDGE = Template(b = [8, -1], z = -1)
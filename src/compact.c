@@ -0,0 +1,394 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "compact.h"
+#include "stencil.h"
+#include "pool.h"
+
+#define FIXED_MAX 32767
+
+SIMD_CLONES
+static void widen_row(float *restrict dst, const int16_t *restrict src, float scale, size_t n)
+{
+    #pragma omp simd
+    for (size_t i = 0; i<n; ++i)
+    {
+        dst[i] = src[i]*scale;
+    }
+}
+
+SIMD_CLONES
+static void narrow_row(int16_t *restrict dst, const float *restrict src, float inv, size_t n)
+{
+    /* shifted so that truncation rounds to nearest, which keeps the loop vectorizable */
+    const float bias = FIXED_MAX + 1;
+
+    #pragma omp simd
+    for (size_t i = 0; i<n; ++i)
+    {
+        float v = src[i]*inv + bias + 0.5f;
+        v = v < 1 ? 1 : (v > 2*FIXED_MAX + 1 ? 2*FIXED_MAX + 1 : v);
+        dst[i] = (int16_t) ((int) v - (FIXED_MAX + 1));
+    }
+}
+
+SIMD_CLONES
+static void output_row(float *restrict y, const float *restrict x, size_t n)
+{
+    #pragma omp simd
+    for (size_t i = 0; i<n; ++i)
+    {
+        const float v = x[i];
+        y[i] = v < -1 ? -1 : (v > 1 ? 1 : v);
+    }
+}
+
+SIMD_CLONES
+static void linear_row(float *restrict k, const float *restrict x,
+                       const float *restrict y0, const float *restrict y1,
+                       const float *restrict y2, const float *restrict bu,
+                       const float *restrict a, size_t n)
+{
+    const float a0 = a[0], a1 = a[1], a2 = a[2],
+                a3 = a[3], a4 = a[4], a5 = a[5],
+                a6 = a[6], a7 = a[7], a8 = a[8];
+
+    #pragma omp simd
+    for (size_t i = 0; i<n; ++i)
+    {
+        k[i] = a0*y0[i-1] + a1*y0[i] + a2*y0[i+1] +
+               a3*y1[i-1] + a4*y1[i] + a5*y1[i+1] +
+               a6*y2[i-1] + a7*y2[i] + a8*y2[i+1] +
+               bu[i] - x[i];
+    }
+}
+
+SIMD_CLONES
+static void axpy_row(float *restrict y, const float *restrict x, const float *restrict k, float c, size_t n)
+{
+    #pragma omp simd
+    for (size_t i = 0; i<n; ++i)
+    {
+        y[i] = x[i] + c*k[i];
+    }
+}
+
+SIMD_CLONES
+static void accumulate_row(float *restrict y, const float *restrict k, float c, size_t n)
+{
+    #pragma omp simd
+    for (size_t i = 0; i<n; ++i)
+    {
+        y[i] += c*k[i];
+    }
+}
+
+/*
+   Float planes are used in place. Fixed point rows are widened into buf
+   when read, and rows to be written are built in buf and narrowed by
+   commit_row.
+*/
+static const float *read_row(const compact *c, const void *plane, size_t o, size_t n, float *buf)
+{
+    if (c->precision == PRECISION_FLOAT)
+    {
+        return (const float*) plane + o;
+    }
+    widen_row(buf, (const int16_t*) plane + o, c->scale, n);
+    return buf;
+}
+
+static float *write_row(const compact *c, void *plane, size_t o, float *buf)
+{
+    return c->precision == PRECISION_FLOAT ? (float*) plane + o : buf;
+}
+
+static void commit_row(const compact *c, void *plane, size_t o, const float *row, size_t n)
+{
+    if (c->precision == PRECISION_FIXED16)
+    {
+        narrow_row((int16_t*) plane + o, row, 1/c->scale, n);
+    }
+}
+
+static float get_cell(const compact *c, const void *plane, size_t i)
+{
+    return c->precision == PRECISION_FLOAT ? ((const float*) plane)[i]
+                                           : ((const int16_t*) plane)[i]*c->scale;
+}
+
+static void *create_plane(const compact *c, matrix m)
+{
+    void *plane = pool_alloc(c->size*c->w*c->h);
+
+    #pragma omp parallel for
+    for (size_t y = 0; y<c->h; ++y)
+    {
+        const size_t o = y*c->w;
+        for (size_t x = 0; x<c->w; ++x)
+        {
+            if (c->precision == PRECISION_FLOAT)
+            {
+                ((float*) plane)[o + x] = m.data[o + x];
+            }
+            else
+            {
+                const float v = m.data[o + x];
+                narrow_row((int16_t*) plane + o + x, &v, 1/c->scale, 1);
+            }
+        }
+    }
+
+    return plane;
+}
+
+static void compact_bound(const compact *c, void *plane)
+{
+    const int periodic = c->bnd == bound_periodic;
+    if (!periodic && c->bnd != bound_zeroflux)
+    {
+        return;
+    }
+
+    unsigned char *p = (unsigned char*) plane;
+    const size_t z = c->size,
+                 w = c->w,
+                 h = c->h,
+                 s = c->s;
+
+    /* like bound_periodic and bound_zeroflux: the sides of the inner rows, then whole rows */
+    for (size_t j = s; j<h-s; ++j)
+    {
+        unsigned char *row = p + j*w*z;
+        for (size_t i = 0; i<s; ++i)
+        {
+            memcpy(row + i*z, row + (periodic ? w-2*s+i : s)*z, z);
+            memcpy(row + (w-1-i)*z, row + (periodic ? 2*s-1-i : w-1-s)*z, z);
+        }
+    }
+
+    for (size_t i = 0; i<s; ++i)
+    {
+        memcpy(p + i*w*z, p + (periodic ? h-2*s+i : s)*w*z, w*z);
+        memcpy(p + (h-1-i)*w*z, p + (periodic ? 2*s-1-i : h-1-s)*w*z, w*z);
+    }
+}
+
+int compact_supported(int precision, int method, double active_tol, size_t block_steps,
+                      void (*bnd)(matrix, size_t))
+{
+    const int builtin = bnd == bound_constant || bnd == bound_zeroflux || bnd == bound_periodic;
+    return precision != PRECISION_DOUBLE && method != SOLVER_RK45 && active_tol == 0 &&
+           block_steps < 2 && builtin;
+}
+
+compact create_compact(int precision, int method, double dt, const template3x3 *tmpl,
+                       matrix init, matrix input1, size_t s, void (*bnd)(matrix, size_t))
+{
+    compact c;
+    c.precision = precision;
+    c.w = init.w;
+    c.h = init.h;
+    c.s = s;
+    c.size = precision == PRECISION_FLOAT ? sizeof(float) : sizeof(int16_t);
+    c.method = method;
+    c.h_step = dt;
+    c.bnd = bnd;
+    c.tiles = create_tile_set(init.w, init.h, s, 0);
+    c.stats = profiling();
+
+    linear_engine lin = create_linear_engine(tmpl, input1, s);
+    fill_bounds(lin.bu, s, 0);
+
+    /*
+       |A*phi(x) + B*u + z| never exceeds the sum of |a| plus the largest
+       |bu|, so neither do the states, nor the stages, which lie between x
+       and such a value for steps of at most 1.
+    */
+    double bound = 1, pull = 0, drive = 0;
+    for (int i = 0; i<9; ++i)
+    {
+        c.a[i] = tmpl->a[i];
+        pull += fabs(tmpl->a[i]);
+    }
+    for (size_t i = 0; i<init.w*init.h; ++i)
+    {
+        bound = fmax(bound, fabs(init.data[i]));
+        drive = fmax(drive, fabs(lin.bu.data[i]));
+    }
+    bound = fmax(bound, pull + drive);
+    c.scale = precision == PRECISION_FIXED16 ? bound/FIXED_MAX : 1;
+
+    c.x = create_plane(&c, init);
+    c.next = create_plane(&c, init);
+    c.stage[0] = create_plane(&c, init);
+    c.stage[1] = create_plane(&c, init);
+    c.bu = create_plane(&c, lin.bu);
+    free_linear_engine(&lin);
+
+    return c;
+}
+
+void free_compact(compact *c)
+{
+    free_tile_set(&c->tiles);
+    pool_free(c->x);
+    pool_free(c->next);
+    pool_free(c->stage[0]);
+    pool_free(c->stage[1]);
+    pool_free(c->bu);
+}
+
+/*
+   The rows of src are widened once into a ring of three, next to the ring
+   of their outputs, and the middle one also serves as the -x term.
+*/
+static void compact_rect(const compact *c, const void *src, void *next, void *stage,
+                         float cn, float cs, int first, rect r, float *buf)
+{
+    const size_t n = r.x1 - r.x0,
+                 m = n + 2;
+    float *ring[3] = {buf, buf + m, buf + 2*m},
+          *wide[3] = {buf + 3*m, buf + 4*m, buf + 5*m},
+          *xb = buf + 6*m,
+          *bb = buf + 7*m,
+          *k = buf + 8*m,
+          *nb = buf + 9*m,
+          *sb = buf + 10*m;
+    const float *row[3];
+
+    for (int i = 0; i<2; ++i)
+    {
+        row[i] = read_row(c, src, (r.y0-1+i)*c->w + r.x0-1, m, wide[i]);
+        output_row(ring[i], row[i], m);
+    }
+
+    for (size_t y = r.y0; y<r.y1; ++y)
+    {
+        const size_t i = y - r.y0,
+                     o = y*c->w + r.x0;
+        row[(i+2)%3] = read_row(c, src, o + c->w - 1, m, wide[(i+2)%3]);
+        output_row(ring[(i+2)%3], row[(i+2)%3], m);
+
+        const float *vr = row[(i+1)%3] + 1,
+                    *xr = src == c->x ? vr : read_row(c, c->x, o, n, xb),
+                    *bu = read_row(c, c->bu, o, n, bb);
+        linear_row(k, vr, ring[i%3] + 1, ring[(i+1)%3] + 1, ring[(i+2)%3] + 1, bu, c->a, n);
+
+        /* for float planes nr is the row itself, otherwise it is widened into nb */
+        float *nr = write_row(c, next, o, nb);
+        if (first)
+        {
+            axpy_row(nr, xr, k, cn, n);
+        }
+        else
+        {
+            read_row(c, next, o, n, nb);
+            accumulate_row(nr, k, cn, n);
+        }
+        commit_row(c, next, o, nr, n);
+
+        if (stage)
+        {
+            float *sr = write_row(c, stage, o, sb);
+            axpy_row(sr, xr, k, cs, n);
+            commit_row(c, stage, o, sr, n);
+        }
+    }
+}
+
+static void compact_pass(const compact *c, const void *src, void *stage, float cn, float cs, int first)
+{
+    const tile_set *ts = &c->tiles;
+    const size_t m = (TILE_WIDTH > c->s ? TILE_WIDTH : c->s) + 2;
+
+    #pragma omp parallel
+    {
+        float *buf = (float*) pool_scratch(SCRATCH_COMPACT, sizeof(float)*11*m);
+
+        #pragma omp for schedule(dynamic)
+        for (size_t i = 0; i<ts->nactive; ++i)
+        {
+            const rect r = ts->tiles[ts->active[i]];
+            const double start = c->stats ? stats_clock() : 0;
+            compact_rect(c, src, c->next, stage, cn, cs, first, r, buf);
+            if (c->stats)
+            {
+                stats_work(c->stats, (r.x1 - r.x0)*(r.y1 - r.y0), start);
+            }
+        }
+    }
+}
+
+size_t compact_step(compact *c, double *t)
+{
+    const scheme *m = &schemes[c->method];
+    const double dt = c->h_step;
+    const void *src = c->x;
+
+    compact_bound(c, c->x);
+    for (int i = 0; i<m->n; ++i)
+    {
+        void *stage = i+1 < m->n ? c->stage[i%2] : NULL;
+        compact_pass(c, src, stage, dt/m->weight[i], m->ahead[i] ? dt/m->ahead[i] : 0, i == 0);
+        if (stage)
+        {
+            compact_bound(c, stage);
+        }
+        src = stage;
+    }
+
+    void *tmp = c->x;
+    c->x = c->next;
+    c->next = tmp;
+    *t += dt;
+
+    return 1;
+}
+
+/* grid_rate for the last step, which went from next to x. */
+double compact_rate(const compact *c, double h, int *settled)
+{
+    double rate = 0;
+    int moving = 0;
+
+    #pragma omp parallel for reduction(max:rate) reduction(|:moving)
+    for (size_t r = c->s; r<c->h-c->s; ++r)
+    {
+        for (size_t col = c->s; col<c->w-c->s; ++col)
+        {
+            const float a = get_cell(c, c->next, r*c->w + col),
+                        b = get_cell(c, c->x, r*c->w + col);
+            rate = fmax(rate, fabsf(b - a));
+            moving |= fabsf(a) < 1 || fabsf(b) < 1 || (a < 0) != (b < 0);
+        }
+    }
+
+    *settled = !moving;
+    return rate/h;
+}
+
+void compact_load(const compact *c, matrix out)
+{
+    #pragma omp parallel for
+    for (size_t y = 0; y<c->h; ++y)
+    {
+        for (size_t x = 0; x<c->w; ++x)
+        {
+            out.data[y*c->w + x] = get_cell(c, c->x, y*c->w + x);
+        }
+    }
+}
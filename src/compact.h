@@ -0,0 +1,51 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#ifndef CNN_COMPACT_H
+#define CNN_COMPACT_H
+
+#include "cnn.h"
+#include "solver.h"
+
+/*
+   Linear 3x3 templates integrated on reduced precision planes. The state,
+   the stage planes and the feedforward term are stored as float or as 16 bit
+   fixed point numbers and widened to float one row at a time, so a step
+   moves a half or a quarter of the bytes the double path does. Fixed point
+   numbers share one scale, chosen so that no state the network can reach
+   overflows.
+*/
+typedef struct
+{
+    int precision;
+    size_t w, h, s, size;
+    float scale;
+    void *x, *next, *stage[2], *bu;
+    float a[9];
+    int method;
+    double h_step;
+    void (*bnd)(matrix, size_t);
+    tile_set tiles;
+    cnn_stats *stats;
+} compact;
+
+int compact_supported(int precision, int method, double active_tol, size_t block_steps,
+                      void (*bnd)(matrix, size_t));
+compact create_compact(int precision, int method, double dt, const template3x3 *tmpl,
+                       matrix init, matrix input1, size_t s, void (*bnd)(matrix, size_t));
+void free_compact(compact *c);
+size_t compact_step(compact *c, double *t);
+double compact_rate(const compact *c, double h, int *settled);
+void compact_load(const compact *c, matrix out);
+
+#endif
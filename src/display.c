@@ -0,0 +1,206 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "display.h"
+#include "stream.h"
+
+/*
+   buf[1] belongs to the solver while ready is 0 and to the render thread
+   while it is 1; the render thread swaps it with buf[0], which it draws
+   from, before clearing ready.
+*/
+static void draw(preview *p, const Uint32 *grey)
+{
+    void *pixels;
+    int pitch;
+    if (SDL_LockTexture(p->texture, NULL, &pixels, &pitch) < 0)
+    {
+        return;
+    }
+
+    for (size_t y = 0; y<p->h; ++y)
+    {
+        const unsigned char *src = p->buf[0] + y*p->w;
+        Uint32 *row = (Uint32*) ((Uint8*) pixels + y*pitch);
+        for (size_t x = 0; x<p->w; ++x)
+        {
+            row[x] = grey[src[x]];
+        }
+    }
+
+    SDL_UnlockTexture(p->texture);
+    SDL_RenderCopy(p->renderer, p->texture, NULL, NULL);
+    SDL_RenderPresent(p->renderer);
+}
+
+static void release(preview *p)
+{
+    if (p->texture)
+    {
+        SDL_DestroyTexture(p->texture);
+    }
+    if (p->renderer)
+    {
+        SDL_DestroyRenderer(p->renderer);
+    }
+}
+
+static int render(void *data)
+{
+    preview *p = (preview*) data;
+    p->renderer = SDL_CreateRenderer(p->window, -1, 0);
+    p->texture = p->renderer ? SDL_CreateTexture(p->renderer, SDL_PIXELFORMAT_ARGB8888,
+                                                 SDL_TEXTUREACCESS_STREAMING, p->w, p->h) : NULL;
+    if (!p->texture)
+    {
+        fputs(SDL_GetError(), stderr);
+        release(p);
+        atomic_store(&p->status, PREVIEW_FAILED);
+        return 1;
+    }
+    atomic_store(&p->status, PREVIEW_DRAWING);
+
+    Uint32 grey[256];
+    for (Uint32 i = 0; i<256; ++i)
+    {
+        grey[i] = 0xff000000u | i << 16 | i << 8 | i;
+    }
+
+    while (1)
+    {
+        /* a snapshot handed over before stopping is still drawn */
+        const int stop = !atomic_load(&p->running);
+        if (atomic_load(&p->ready))
+        {
+            unsigned char *tmp = p->buf[0];
+            p->buf[0] = p->buf[1];
+            p->buf[1] = tmp;
+            atomic_store(&p->ready, 0);
+            draw(p, grey);
+        }
+        if (stop)
+        {
+            break;
+        }
+        SDL_Delay(p->frame > 0 ? p->frame : 1);
+    }
+
+    /* the renderer is kept, and with it the last frame, until free_preview */
+    atomic_store(&p->status, PREVIEW_IDLE);
+    while (atomic_load(&p->alive))
+    {
+        SDL_Delay(10);
+    }
+    release(p);
+    return 0;
+}
+
+preview *start_preview(SDL_Window *window, size_t w, size_t h, size_t every, double fps)
+{
+    preview *p = (preview*) calloc(1, sizeof(preview));
+    p->window = window;
+    p->w = w;
+    p->h = h;
+    p->every = every > 0 ? every : 1;
+    p->frame = fps > 0 ? 1000/fps : 0;
+    p->buf[0] = (unsigned char*) calloc(w*h, 1);
+    p->buf[1] = (unsigned char*) calloc(w*h, 1);
+    atomic_init(&p->ready, 0);
+    atomic_init(&p->running, 1);
+    atomic_init(&p->alive, 1);
+    atomic_init(&p->status, PREVIEW_STARTING);
+    if (thrd_create(&p->thread, render, p) != thrd_success)
+    {
+        fputs("can't start the render thread\n", stderr);
+        free(p->buf[0]);
+        free(p->buf[1]);
+        free(p);
+        return NULL;
+    }
+
+    /* the render thread reports whether it could make a renderer */
+    while (atomic_load(&p->status) == PREVIEW_STARTING)
+    {
+        SDL_Delay(1);
+    }
+    if (atomic_load(&p->status) == PREVIEW_FAILED)
+    {
+        free_preview(p);
+        return NULL;
+    }
+
+    return p;
+}
+
+int preview_due(preview *p)
+{
+    const int due = p->step % p->every == 0 && !atomic_load(&p->ready) && SDL_GetTicks() >= p->due;
+    ++p->step;
+    return due;
+}
+
+void preview_snapshot(preview *p, matrix m)
+{
+    const size_t w = m.w < p->w ? m.w : p->w,
+                 h = m.h < p->h ? m.h : p->h;
+    unsigned char *back = p->buf[1];
+
+    #pragma omp parallel for
+    for (size_t y = 0; y<h; ++y)
+    {
+        encode_row(back + y*p->w, m.data + y*m.stride, w);
+    }
+
+    p->due = SDL_GetTicks() + p->frame;
+    atomic_store(&p->ready, 1);
+}
+
+void update_preview(matrix m, void *data)
+{
+    preview *p = (preview*) data;
+    if (preview_due(p))
+    {
+        preview_snapshot(p, m);
+    }
+}
+
+void stop_preview(preview *p, matrix last)
+{
+    /* the run is over, so waiting for the render thread costs nothing */
+    if (last.data)
+    {
+        while (atomic_load(&p->ready))
+        {
+            SDL_Delay(1);
+        }
+        preview_snapshot(p, last);
+    }
+
+    atomic_store(&p->running, 0);
+    while (atomic_load(&p->status) == PREVIEW_DRAWING)
+    {
+        SDL_Delay(1);
+    }
+}
+
+void free_preview(preview *p)
+{
+    atomic_store(&p->running, 0);
+    atomic_store(&p->alive, 0);
+    thrd_join(p->thread, NULL);
+    free(p->buf[0]);
+    free(p->buf[1]);
+    free(p);
+}
@@ -0,0 +1,65 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#ifndef CNN_DISPLAY_H
+#define CNN_DISPLAY_H
+
+#include <stdatomic.h>
+#include <threads.h>
+#include <SDL.h>
+#include "cnn.h"
+
+/*
+   A window that shows a simulation while it runs, drawn by a thread of its
+   own. The solver takes a snapshot of the state as grey levels on every
+   every-th step, but only once the render thread has taken the previous
+   one and a frame is due, so it never waits for the display and frames
+   that wouldn't be shown are never copied. The render thread swaps the
+   snapshot with the one it drew last and uploads it to a streaming
+   texture, at most fps times a second. SDL renderers may only be used by
+   the thread that created them, so the renderer and the texture belong to
+   the render thread from start to end; status tells how far it got.
+*/
+#define PREVIEW_FAILED -1
+#define PREVIEW_STARTING 0
+#define PREVIEW_DRAWING 1
+#define PREVIEW_IDLE 2
+
+typedef struct
+{
+    SDL_Window *window;
+    SDL_Renderer *renderer;
+    SDL_Texture *texture;
+    size_t w, h;
+    size_t every, step;
+    Uint32 frame, due;
+    unsigned char *buf[2];
+    atomic_int ready, running, alive, status;
+    thrd_t thread;
+} preview;
+
+/* NULL, after printing why, if the window can't be drawn to. */
+preview *start_preview(SDL_Window *window, size_t w, size_t h, size_t every, double fps);
+
+/* Whether the state of this step should be shown; counts the steps. */
+int preview_due(preview *p);
+void preview_snapshot(preview *p, matrix m);
+
+/* The update function of run_cnn for a preview. */
+void update_preview(matrix m, void *data);
+
+/* Shows last and stops drawing; the window keeps showing it until free_preview. */
+void stop_preview(preview *p, matrix last);
+void free_preview(preview *p);
+
+#endif
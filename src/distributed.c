@@ -0,0 +1,391 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "distributed.h"
+#include "solver.h"
+
+#ifdef CNN_MPI
+
+#include <mpi.h>
+
+static int started;
+
+int distributed_rank()
+{
+    int initialized, rank;
+    MPI_Initialized(&initialized);
+    if (!initialized)
+    {
+        /* only the thread that runs the template talks to the other processes */
+        int provided;
+        MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &provided);
+        started = 1;
+    }
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    return rank;
+}
+
+void finish_distributed()
+{
+    int finalized;
+    if (started && (MPI_Finalized(&finalized), !finalized))
+    {
+        MPI_Finalize();
+    }
+}
+
+int distributed_all(int ok)
+{
+    int all;
+    distributed_rank();
+    MPI_Allreduce(&ok, &all, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    return all;
+}
+
+/*
+   The eight neighbors of a block, row by row from the top left one, as
+   (x, y) offsets in the grid of blocks. Neighbor 7-k is on the opposite
+   side of neighbor k, so what is sent towards k is received from 7-k.
+*/
+static const int offsets[8][2] =
+{
+    {-1, -1}, {0, -1}, {1, -1},
+    {-1, 0}, {1, 0},
+    {-1, 1}, {0, 1}, {1, 1}
+};
+
+/*
+   The halo of a block: the strips sent to and received from each neighbor,
+   and the sides of the block that are on the edge of the image, in the
+   order left, right, top, bottom.
+*/
+typedef struct
+{
+    MPI_Comm comm;
+    int nbr[8];
+    int edge[4];
+    int zeroflux;
+    MPI_Datatype send[8], recv[8];
+    MPI_Request req[16];
+} domain;
+
+/* The cells [*a, *b) of block i of n along an axis of len cells. */
+static void split(size_t len, int n, int i, size_t *a, size_t *b)
+{
+    *a = len*i/n;
+    *b = len*(i+1)/n;
+}
+
+/* Where the strip of a plane of n cells towards side d (-1, 0 or 1) starts, and its halo part. */
+static int strip_start(int d, size_t n, size_t s, int halo)
+{
+    if (d == 0)
+    {
+        return s;
+    }
+    return d < 0 ? (halo ? 0 : s) : (halo ? n-s : n-2*s);
+}
+
+static MPI_Datatype strip_type(const int *d, size_t w, size_t h, size_t s, int halo)
+{
+    const int sizes[2] = {h, w},
+              sub[2] = {d[1] ? s : h-2*s, d[0] ? s : w-2*s},
+              starts[2] = {strip_start(d[1], h, s, halo), strip_start(d[0], w, s, halo)};
+    MPI_Datatype type;
+    MPI_Type_create_subarray(2, sizes, sub, starts, MPI_ORDER_C, MPI_DOUBLE, &type);
+    MPI_Type_commit(&type);
+    return type;
+}
+
+/* The halo of w x h planes of the block of this process in the grid of blocks cart. */
+static void create_domain(domain *d, MPI_Comm cart, size_t w, size_t h, size_t s, int zeroflux)
+{
+    int dims[2], periods[2], coords[2];
+    MPI_Cart_get(cart, 2, dims, periods, coords);
+
+    d->comm = cart;
+    d->zeroflux = zeroflux;
+    d->edge[0] = !periods[1] && coords[1] == 0;
+    d->edge[1] = !periods[1] && coords[1] == dims[1]-1;
+    d->edge[2] = !periods[0] && coords[0] == 0;
+    d->edge[3] = !periods[0] && coords[0] == dims[0]-1;
+
+    for (int k = 0; k<8; ++k)
+    {
+        int c[2] = {coords[0] + offsets[k][1], coords[1] + offsets[k][0]};
+        const int outside = c[0] < 0 || c[0] >= dims[0] || c[1] < 0 || c[1] >= dims[1];
+        if (outside && !periods[0])
+        {
+            d->nbr[k] = MPI_PROC_NULL;
+        }
+        else
+        {
+            MPI_Cart_rank(cart, c, &d->nbr[k]);
+        }
+        d->send[k] = strip_type(offsets[k], w, h, s, 0);
+        d->recv[k] = strip_type(offsets[k], w, h, s, 1);
+    }
+}
+
+static void free_domain(domain *d)
+{
+    for (int k = 0; k<8; ++k)
+    {
+        MPI_Type_free(&d->send[k]);
+        MPI_Type_free(&d->recv[k]);
+    }
+}
+
+static void begin_exchange(matrix m, size_t s, void *data)
+{
+    domain *d = (domain*) data;
+    for (int k = 0; k<8; ++k)
+    {
+        MPI_Irecv(m.data, 1, d->recv[k], d->nbr[k], 7-k, d->comm, &d->req[k]);
+    }
+    for (int k = 0; k<8; ++k)
+    {
+        MPI_Isend(m.data, 1, d->send[k], d->nbr[k], k, d->comm, &d->req[8+k]);
+    }
+}
+
+/*
+   Sides on the edge of the image are filled like bound_zeroflux does, over
+   the rows received from the neighbors too, so the corners match it.
+   Constant sides keep the value they were filled with, and periodic grids
+   have no edges.
+*/
+static void end_exchange(matrix m, size_t s, void *data)
+{
+    domain *d = (domain*) data;
+    MPI_Waitall(16, d->req, MPI_STATUSES_IGNORE);
+    if (!d->zeroflux)
+    {
+        return;
+    }
+
+    const size_t w = m.w,
+                 h = m.h;
+    if (d->edge[0] || d->edge[1])
+    {
+        for (size_t j = 0; j<h; ++j)
+        {
+            double *row = m.data + j*w;
+            const double left = row[s],
+                         right = row[w-1-s];
+            for (size_t i = 0; i<s && d->edge[0]; ++i)
+            {
+                row[i] = left;
+            }
+            for (size_t i = 0; i<s && d->edge[1]; ++i)
+            {
+                row[w-1-i] = right;
+            }
+        }
+    }
+
+    for (size_t i = 0; i<s; ++i)
+    {
+        if (d->edge[2])
+        {
+            memcpy(m.data + i*w, m.data + s*w, sizeof(double)*w);
+        }
+        if (d->edge[3])
+        {
+            memcpy(m.data + (h-1-i)*w, m.data + (h-1-s)*w, sizeof(double)*w);
+        }
+    }
+}
+
+/* h rows of w doubles, stride apart. */
+static MPI_Datatype block_type(size_t w, size_t h, size_t stride)
+{
+    MPI_Datatype type;
+    MPI_Type_vector(h, w, stride, MPI_DOUBLE, &type);
+    MPI_Type_commit(&type);
+    return type;
+}
+
+/* The interior of every block into m on rank 0 of cart. */
+static void gather_blocks(MPI_Comm cart, matrix res, size_t s, matrix *m, size_t w, size_t h)
+{
+    int rank, size, dims[2], periods[2], coords[2];
+    MPI_Comm_rank(cart, &rank);
+    MPI_Comm_size(cart, &size);
+    MPI_Cart_get(cart, 2, dims, periods, coords);
+
+    MPI_Datatype own = block_type(res.w - 2*s, res.h - 2*s, res.w);
+    MPI_Request req;
+    MPI_Isend(res.data + s*res.w + s, 1, own, 0, 0, cart, &req);
+    if (rank == 0)
+    {
+        for (int r = 0; r<size; ++r)
+        {
+            size_t x0, x1, y0, y1;
+            MPI_Cart_coords(cart, r, 2, coords);
+            split(w, dims[1], coords[1], &x0, &x1);
+            split(h, dims[0], coords[0], &y0, &y1);
+
+            MPI_Datatype block = block_type(x1-x0, y1-y0, m->stride);
+            MPI_Recv(m->data + y0*m->stride + x0, 1, block, r, 0, cart, MPI_STATUS_IGNORE);
+            MPI_Type_free(&block);
+        }
+    }
+    MPI_Wait(&req, MPI_STATUS_IGNORE);
+    MPI_Type_free(&own);
+}
+
+int run_distributed(const mapped_plane *init, const mapped_plane *input1, const mapped_plane *input2,
+                    mapped_plane *out, matrix *gathered, size_t s,
+                    double (*cell)(size_t, size_t, matrix, matrix, matrix, double, void*), void *cell_data,
+                    void (*bnd)(matrix, size_t), double fill, double dt, double t_end, int solver,
+                    run_options opt, run_info *info)
+{
+    const size_t w = init->w,
+                 h = init->h;
+    const int periodic = bnd == bound_periodic,
+              zeroflux = bnd == bound_zeroflux;
+    if (solver == SOLVER_RK45)
+    {
+        fputs("runs with an adaptive step size can't be split between processes\n", stderr);
+        return 0;
+    }
+    if (!periodic && !zeroflux && bnd != bound_constant)
+    {
+        fputs("only the built-in boundaries can be split between processes\n", stderr);
+        return 0;
+    }
+    if (input1->w != w || input1->h != h || input2->w != w || input2->h != h ||
+        (out && (out->w != w || out->h != h)))
+    {
+        fputs("the images must be the same size\n", stderr);
+        return 0;
+    }
+
+    /* more blocks along the longer side; every block has to hold what its neighbors need of it */
+    int size, dims[2] = {0, 0};
+    distributed_rank();
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    MPI_Dims_create(size, 2, dims);
+    const int nx = w >= h ? dims[0] : dims[1],
+              ny = w >= h ? dims[1] : dims[0];
+    if (w/nx < 2*s || h/ny < 2*s)
+    {
+        fprintf(stderr, "the image is too small to be split between %d processes\n", size);
+        return 0;
+    }
+
+    MPI_Comm cart;
+    int rank, coords[2];
+    const int grid[2] = {ny, nx},
+              periods[2] = {periodic, periodic};
+    MPI_Cart_create(MPI_COMM_WORLD, 2, grid, periods, 0, &cart);
+    MPI_Comm_rank(cart, &rank);
+    MPI_Cart_coords(cart, rank, 2, coords);
+
+    size_t x0, x1, y0, y1;
+    split(w, nx, coords[1], &x0, &x1);
+    split(h, ny, coords[0], &y0, &y1);
+    const size_t bw = x1-x0,
+                 bh = y1-y0;
+
+    const matrix x = matrix_plane(create_padded_matrix(bw, bh, s));
+    read_window(x, s, init, x0, y0, 0);
+    matrix u1 = x,
+           u2 = x;
+    if (input1 != init)
+    {
+        u1 = matrix_plane(create_padded_matrix(bw, bh, s));
+        read_window(u1, s, input1, x0, y0, 0);
+    }
+    if (input2 == input1)
+    {
+        u2 = u1;
+    }
+    else if (input2 != init)
+    {
+        u2 = matrix_plane(create_padded_matrix(bw, bh, s));
+        read_window(u2, s, input2, x0, y0, 0);
+    }
+    fill_bounds(x, s, fill);
+    fill_bounds(u1, s, fill);
+    fill_bounds(u2, s, fill);
+
+    domain d;
+    create_domain(&d, cart, x.w, x.h, s, zeroflux);
+    const halo_ops ops = {begin_exchange, end_exchange, &d};
+    exchange_halos(&ops);
+    /* every cell takes every step in double precision, as the halos are exchanged for each one */
+    opt.active_tol = 0;
+    opt.block_steps = 1;
+    opt.precision = PRECISION_DOUBLE;
+    opt.conv = NOCONV;
+    const matrix res = run_cnn(x, u1, u2, s, cell, cell_data, bound_halo, dt, t_end, solver, opt, info,
+                               update_nothing, NULL);
+    exchange_halos(NULL);
+
+    if (out)
+    {
+        write_window(out, res, s, s, x0, y0, bw, bh);
+    }
+    int gather = gathered != NULL;
+    MPI_Bcast(&gather, 1, MPI_INT, 0, cart);
+    if (gather)
+    {
+        gather_blocks(cart, res, s, gathered, w, h);
+    }
+    /* out is complete once every process has returned */
+    MPI_Barrier(cart);
+
+    free_domain(&d);
+    MPI_Comm_free(&cart);
+    free_matrix(res);
+    if (u2.data != x.data && u2.data != u1.data)
+    {
+        free_matrix(u2);
+    }
+    if (u1.data != x.data)
+    {
+        free_matrix(u1);
+    }
+    free_matrix(x);
+    return 1;
+}
+
+#else
+
+int distributed_rank()
+{
+    return -1;
+}
+
+void finish_distributed() {}
+
+int distributed_all(int ok)
+{
+    return ok;
+}
+
+int run_distributed(const mapped_plane *init, const mapped_plane *input1, const mapped_plane *input2,
+                    mapped_plane *out, matrix *gathered, size_t s,
+                    double (*cell)(size_t, size_t, matrix, matrix, matrix, double, void*), void *cell_data,
+                    void (*bnd)(matrix, size_t), double fill, double dt, double t_end, int solver,
+                    run_options opt, run_info *info)
+{
+    fputs("the library was built without MPI\n", stderr);
+    return 0;
+}
+
+#endif
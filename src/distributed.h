@@ -0,0 +1,51 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#ifndef CNN_DISTRIBUTED_H
+#define CNN_DISTRIBUTED_H
+
+#include "cnn.h"
+#include "tiled.h"
+
+/*
+   The rank of this process among those started by mpirun, initializing MPI
+   on the first call; -1 if the library was built without MPI (see the mpi
+   target of the Makefile). finish_distributed shuts MPI down if it was
+   started here.
+*/
+int distributed_rank();
+void finish_distributed();
+
+/* Whether ok is set on every process. */
+int distributed_all(int ok);
+
+/*
+   Run a template on an image split into a grid of blocks, one block per
+   process. Every process reads its block from the mapped files, exchanges
+   the halo of its planes with its neighbors before every stage while it
+   evaluates the cells that don't need it, and applies bnd only where its
+   block is on the edge of the image. The result is written into out when it
+   isn't NULL, and gathered into gathered on rank 0 when that isn't NULL;
+   gathered must be an image of the same size. Only the built-in boundaries
+   and the fixed step solvers are supported; of opt only tol and jit are
+   used, and runs don't stop early.
+   Every process has to call it; returns 0 and prints why if the run can't
+   be done.
+*/
+int run_distributed(const mapped_plane *init, const mapped_plane *input1, const mapped_plane *input2,
+                    mapped_plane *out, matrix *gathered, size_t s,
+                    double (*cell)(size_t, size_t, matrix, matrix, matrix, double, void*), void *cell_data,
+                    void (*bnd)(matrix, size_t), double fill, double dt, double t_end, int solver,
+                    run_options opt, run_info *info);
+
+#endif
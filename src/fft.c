@@ -0,0 +1,240 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#include <math.h>
+#include "fft.h"
+
+/*
+   Transforms are radix 2, on separate planes of real and imaginary parts,
+   so butterflies vectorize. The twiddles of the stage whose butterflies
+   are h apart are stored from h-1 on.
+*/
+typedef struct
+{
+    size_t n;
+    double *wr, *wi;
+    size_t *rev;
+} fft_plan;
+
+static fft_plan create_plan(size_t n)
+{
+    fft_plan p = {n, (double*) malloc(sizeof(double)*n), (double*) malloc(sizeof(double)*n),
+                  (size_t*) malloc(sizeof(size_t)*n)};
+    size_t bits = 0;
+    while (((size_t) 1 << bits) < n)
+    {
+        ++bits;
+    }
+
+    const double pi = acos(-1);
+    for (size_t h = 1; h<n; h *= 2)
+    {
+        for (size_t j = 0; j<h; ++j)
+        {
+            p.wr[h-1 + j] = cos(pi*j/h);
+            p.wi[h-1 + j] = -sin(pi*j/h);
+        }
+    }
+    for (size_t i = 0; i<n; ++i)
+    {
+        size_t r = 0;
+        for (size_t b = 0; b<bits; ++b)
+        {
+            r |= ((i >> b) & 1) << (bits-1-b);
+        }
+        p.rev[i] = r;
+    }
+
+    return p;
+}
+
+static void free_plan(fft_plan *p)
+{
+    free(p->wr);
+    free(p->wi);
+    free(p->rev);
+}
+
+/* In-place transform of every row of an n x n plane; inverse is unscaled. */
+static void fft_rows(const fft_plan *p, double *re, double *im, int inverse)
+{
+    const size_t n = p->n;
+    const double sign = inverse ? -1 : 1;
+
+    for (size_t y = 0; y<n; ++y)
+    {
+        double *xr = re + y*n,
+               *xi = im + y*n;
+        for (size_t i = 0; i<n; ++i)
+        {
+            const size_t j = p->rev[i];
+            if (i < j)
+            {
+                double t = xr[i];
+                xr[i] = xr[j];
+                xr[j] = t;
+                t = xi[i];
+                xi[i] = xi[j];
+                xi[j] = t;
+            }
+        }
+
+        for (size_t h = 1; h<n; h *= 2)
+        {
+            const double *cr = p->wr + h-1,
+                         *ci = p->wi + h-1;
+            for (size_t i = 0; i<n; i += 2*h)
+            {
+                double *ar = xr + i, *ai = xi + i,
+                       *br = ar + h, *bi = ai + h;
+
+                #pragma omp simd
+                for (size_t j = 0; j<h; ++j)
+                {
+                    const double wi = sign*ci[j],
+                                 tr = br[j]*cr[j] - bi[j]*wi,
+                                 ti = br[j]*wi + bi[j]*cr[j];
+                    br[j] = ar[j] - tr;
+                    bi[j] = ai[j] - ti;
+                    ar[j] += tr;
+                    ai[j] += ti;
+                }
+            }
+        }
+    }
+}
+
+static void transpose(double *a, size_t n)
+{
+    for (size_t y = 0; y<n; ++y)
+    {
+        for (size_t x = y+1; x<n; ++x)
+        {
+            const double t = a[y*n + x];
+            a[y*n + x] = a[x*n + y];
+            a[x*n + y] = t;
+        }
+    }
+}
+
+/* The forward transform leaves the spectrum transposed, the inverse takes it so. */
+static void fft_2d(const fft_plan *p, double *re, double *im, int inverse)
+{
+    fft_rows(p, re, im, inverse);
+    transpose(re, p->n);
+    transpose(im, p->n);
+    fft_rows(p, re, im, inverse);
+}
+
+/* Tiles are at least 64 cells wide and four times the halo they carry. */
+static size_t tile_size(size_t r)
+{
+    size_t t = 64;
+    while (t < 8*r)
+    {
+        t *= 2;
+    }
+    return t;
+}
+
+double fft_correlate_cost(size_t r)
+{
+    const double t = tile_size(r),
+                 v = t - 2*r;
+    /* two 2D transforms of t*t points per pair of tiles; the factor is measured against tap_row */
+    return 6*(t/v)*(t/v)*log2(t*t);
+}
+
+void fft_correlate(matrix out, matrix in, const double *b, double z, size_t r, size_t s)
+{
+    const size_t k = 2*r + 1,
+                 t = tile_size(r),
+                 v = t - 2*r,
+                 nx = (in.w - 2*s + v-1)/v,
+                 ny = (in.h - 2*s + v-1)/v,
+                 ntiles = nx*ny;
+    fft_plan plan = create_plan(t);
+
+    /* the spectrum of b mirrored, so that the product correlates; the 1/t^2 of the inverse is folded in */
+    double *kr = (double*) calloc(2*t*t, sizeof(double)),
+           *ki = kr + t*t;
+    for (size_t j = 0; j<k; ++j)
+    {
+        for (size_t i = 0; i<k; ++i)
+        {
+            kr[((t + r - j) % t)*t + (t + r - i) % t] = b[j*k + i]/((double) t*t);
+        }
+    }
+    fft_2d(&plan, kr, ki, 0);
+
+    #pragma omp parallel
+    {
+        double *re = (double*) malloc(sizeof(double)*2*t*t),
+               *im = re + t*t;
+
+        #pragma omp for schedule(dynamic)
+        for (size_t pair = 0; pair<(ntiles+1)/2; ++pair)
+        {
+            size_t x0[2], y0[2];
+            for (int h = 0; h<2; ++h)
+            {
+                const size_t tile = 2*pair + h < ntiles ? 2*pair + h : 2*pair;
+                x0[h] = s + (tile % nx)*v;
+                y0[h] = s + (tile / nx)*v;
+            }
+
+            /* the tile with origin (x0, y0) reads the cells r before it, which are in the plane */
+            for (size_t ly = 0; ly<t; ++ly)
+            {
+                for (size_t lx = 0; lx<t; ++lx)
+                {
+                    double *c[2] = {re + ly*t + lx, im + ly*t + lx};
+                    for (int h = 0; h<2; ++h)
+                    {
+                        const size_t gx = x0[h] - r + lx,
+                                     gy = y0[h] - r + ly;
+                        *c[h] = gx < in.w && gy < in.h ? in.data[gy*in.w + gx] : 0;
+                    }
+                }
+            }
+
+            fft_2d(&plan, re, im, 0);
+            #pragma omp simd
+            for (size_t i = 0; i<t*t; ++i)
+            {
+                const double pr = re[i]*kr[i] - im[i]*ki[i];
+                im[i] = re[i]*ki[i] + im[i]*kr[i];
+                re[i] = pr;
+            }
+            fft_2d(&plan, re, im, 1);
+
+            for (int h = 0; h<2 && 2*pair + h < ntiles; ++h)
+            {
+                for (size_t ly = 0; ly<v && y0[h] + ly < in.h - s; ++ly)
+                {
+                    double *row = out.data + (y0[h] + ly)*out.w;
+                    const double *src = (h ? im : re) + (ly + r)*t + r;
+                    for (size_t lx = 0; lx<v && x0[h] + lx < in.w - s; ++lx)
+                    {
+                        row[x0[h] + lx] = src[lx] + z;
+                    }
+                }
+            }
+        }
+
+        free(re);
+    }
+
+    free(kr);
+    free_plan(&plan);
+}
@@ -0,0 +1,31 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#ifndef CNN_FFT_H
+#define CNN_FFT_H
+
+#include "cnn.h"
+
+/*
+   Sets the interior of out to z plus the template b, (2r+1)x(2r+1) large,
+   applied to in the way B is applied to the input, for planes with s >= r
+   boundary cells. The plane is cut into overlapping square tiles which are
+   transformed two at a time, one as the real and one as the imaginary part,
+   so the cost per cell depends only on the tile size, not on r.
+*/
+void fft_correlate(matrix out, matrix in, const double *b, double z, size_t r, size_t s);
+
+/* Roughly how many multiply-adds per cell fft_correlate costs for radius r. */
+double fft_correlate_cost(size_t r);
+
+#endif
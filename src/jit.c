@@ -0,0 +1,472 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <threads.h>
+#include "jit.h"
+
+extern char **environ;
+
+typedef struct
+{
+    char *data;
+    size_t len, cap;
+} source;
+
+static void emit(source *src, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    if (src->len + n + 1 > src->cap)
+    {
+        src->cap = 2*(src->len + n + 1);
+        src->data = (char*) realloc(src->data, src->cap);
+    }
+
+    va_start(args, fmt);
+    vsnprintf(src->data + src->len, n + 1, fmt, args);
+    va_end(args);
+    src->len += n;
+}
+
+/* Neighbor k of the plane the nonlinear templates number p; p_ are the rows of phi(x). */
+static void emit_cell(source *src, int p, int k)
+{
+    static const char *rows[4] = {"x_", "p_", "u_", "v_"};
+    static const char *offsets[3] = {"i-1", "i", "i+1"};
+
+    emit(src, "%s%d[%s]", rows[p], k/3, offsets[k%3]);
+}
+
+/*
+   Adds c*plane[k] for every k, summing the neighbors that share a
+   coefficient first. With d set, the terms are phid(plane[k] - c) instead.
+*/
+static void emit_terms(source *src, const double *coef, int p, int d)
+{
+    int done[9] = {0};
+    for (int k = 0; k<9; ++k)
+    {
+        if (coef[k] == 0 || done[k])
+        {
+            continue;
+        }
+
+        const double c = coef[k];
+        if (c == 1 || c == -1)
+        {
+            emit(src, c == 1 ? " + (" : " - (");
+        }
+        else
+        {
+            emit(src, " + %.17g*(", c);
+        }
+
+        for (int j = k; j<9; ++j)
+        {
+            if (coef[j] == c)
+            {
+                done[j] = 1;
+                emit(src, j == k ? "" : " + ");
+                emit(src, d ? "phid(" : "");
+                emit_cell(src, p, j);
+                emit(src, d ? " - c)" : "");
+            }
+        }
+        emit(src, ")");
+    }
+}
+
+/* The body of phid, or 0 if the nonlinearity is not one of the built-in ones. */
+static int emit_phid(source *src, const template3x3 *tmpl)
+{
+    const double *p = (const double*) tmpl->phi_data;
+
+    if (tmpl->phi == nonlin_standard)
+    {
+        emit(src, "    return v < -1 ? -1 : (v > 1 ? 1 : v);\n");
+    }
+    else if (tmpl->phi == nonlin_sign)
+    {
+        emit(src, "    return v < 0 ? -1 : 1;\n");
+    }
+    else if (tmpl->phi == nonlin_absval)
+    {
+        emit(src, "    return v < 0 ? -v : v;\n");
+    }
+    else if (tmpl->phi == nonlin_pw_constant && (int) p[0] % 2 == 1)
+    {
+        const int n = p[0];
+        emit(src, "    return ");
+        for (int i = 1; i+1<n; i += 2)
+        {
+            emit(src, "v < %.17g ? %.17g : ", p[i], p[i+1]);
+        }
+        emit(src, "%.17g;\n", p[n-1]);
+    }
+    else if (tmpl->phi == nonlin_pw_linear && (int) p[0] % 3 == 1)
+    {
+        const int n = p[0];
+        emit(src, "    return ");
+        for (int i = 1; i+2<n; i += 3)
+        {
+            emit(src, "v < %.17g ? v*%.17g + %.17g : ", p[i], p[i+1], p[i+2]);
+        }
+        emit(src, "v*%.17g + %.17g;\n", p[n-2], p[n-1]);
+    }
+    else
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+static int generate(source *src, const template3x3 *tmpl, int nonlinear)
+{
+    static const double none[9] = {0};
+    const double *d = nonlinear ? tmpl->d : none;
+    int uses[4] = {0};
+    for (int k = 0; k<9; ++k)
+    {
+        uses[1] |= tmpl->a[k] != 0;
+        uses[tmpl->dkl] |= d[k] != 0;
+        uses[tmpl->dij] |= d[k] != 0;
+    }
+    const int has_d = uses[tmpl->dkl];
+
+    emit(src, "#include <stddef.h>\n\n");
+    emit(src, "static inline double phi(double v)\n{\n");
+    emit(src, "    return v < -1 ? -1 : (v > 1 ? 1 : v);\n}\n\n");
+    if (has_d)
+    {
+        emit(src, "static inline double phid(double v)\n{\n");
+        if (!emit_phid(src, tmpl))
+        {
+            return 0;
+        }
+        emit(src, "}\n\n");
+    }
+
+    /* like linear_eval, phi(x) is computed once per cell into a ring of three rows */
+    emit(src, "void cnn_kernel(double *restrict dx, const double *restrict x, const double *restrict bu,\n"
+              "                const double *restrict u1, const double *restrict u2,\n"
+              "                size_t w, size_t x0, size_t y0, size_t x1, size_t y1)\n{\n");
+    emit(src, "    const size_t n = x1 - x0;\n");
+    if (uses[1])
+    {
+        emit(src, "    double ring[3][n+2];\n\n");
+        emit(src, "    for (size_t j = 0; j<2; ++j)\n    {\n");
+        emit(src, "        const double *row = x + (y0-1+j)*w + x0-1;\n");
+        emit(src, "        for (size_t i = 0; i<n+2; ++i)\n        {\n");
+        emit(src, "            ring[j][i] = phi(row[i]);\n        }\n    }\n\n");
+    }
+    emit(src, "    for (size_t y = y0; y<y1; ++y)\n    {\n");
+    emit(src, "        const double *x_0 = x + (y-1)*w + x0, *x_1 = x + y*w + x0, *x_2 = x + (y+1)*w + x0;\n");
+    if (uses[1])
+    {
+        emit(src, "        const size_t r = y - y0;\n");
+        emit(src, "        for (size_t i = 0; i<n+2; ++i)\n        {\n");
+        emit(src, "            ring[(r+2)%%3][i] = phi(x_2[i-1]);\n        }\n");
+        emit(src, "        const double *p_0 = ring[r%%3] + 1, *p_1 = ring[(r+1)%%3] + 1, *p_2 = ring[(r+2)%%3] + 1;\n");
+    }
+    if (uses[2])
+    {
+        emit(src, "        const double *u_0 = u1 + (y-1)*w + x0, *u_1 = u1 + y*w + x0, *u_2 = u1 + (y+1)*w + x0;\n");
+    }
+    if (uses[3])
+    {
+        emit(src, "        const double *v_0 = u2 + (y-1)*w + x0, *v_1 = u2 + y*w + x0, *v_2 = u2 + (y+1)*w + x0;\n");
+    }
+    emit(src, "        const double *b = bu + y*w + x0;\n");
+    emit(src, "        double *d = dx + y*w + x0;\n\n");
+    emit(src, "        #pragma omp simd\n");
+    emit(src, "        for (size_t i = 0; i<n; ++i)\n        {\n");
+    if (has_d)
+    {
+        emit(src, "            const double c = ");
+        emit_cell(src, tmpl->dij, 4);
+        emit(src, ";\n");
+    }
+    emit(src, "            d[i] = b[i] - x_1[i]");
+    emit_terms(src, tmpl->a, 1, 0);
+    if (has_d)
+    {
+        emit_terms(src, d, tmpl->dkl, 1);
+    }
+    emit(src, ";\n        }\n    }\n}\n");
+
+    return 1;
+}
+
+/* FNV-1a, continued from h */
+static uint64_t hash_bytes(uint64_t h, const char *data, size_t n)
+{
+    for (size_t i = 0; i<n; ++i)
+    {
+        h = (h ^ (unsigned char) data[i])*1099511628211ULL;
+    }
+    return h;
+}
+
+static const char *compiler()
+{
+    const char *cc = getenv("CC");
+    return cc && *cc ? cc : "cc";
+}
+
+/*
+   What a kernel is built for. Kernels are compiled for the CPU they are
+   built on, so a cache shared between machines, like a home directory on
+   NFS or the nodes of an MPI job, must not hand one machine the kernel of
+   another: the compiler and the model and features of the CPU are hashed
+   with the source. Without /proc/cpuinfo the host name stands for the CPU.
+*/
+static char cpu[16384];
+
+static void read_cpu()
+{
+    size_t len = 0;
+    char line[8192];
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    while (f && fgets(line, sizeof(line), f))
+    {
+        /* the first processor is enough */
+        if (line[0] == '\n' && len > 0)
+        {
+            break;
+        }
+        const size_t n = strlen(line);
+        if ((strncmp(line, "model name", 10) == 0 || strncmp(line, "flags", 5) == 0 ||
+             strncmp(line, "CPU part", 8) == 0 || strncmp(line, "Features", 8) == 0) &&
+            len + n < sizeof(cpu))
+        {
+            memcpy(cpu + len, line, n + 1);
+            len += n;
+        }
+    }
+    if (f)
+    {
+        fclose(f);
+    }
+
+    if (len == 0)
+    {
+        gethostname(cpu, sizeof(cpu) - 1);
+    }
+}
+
+static const char *cpu_signature()
+{
+    static once_flag once = ONCE_FLAG_INIT;
+    call_once(&once, read_cpu);
+    return cpu;
+}
+
+static uint64_t hash_kernel(const source *src)
+{
+    const char *cc = compiler(),
+               *cpu = cpu_signature();
+    uint64_t h = hash_bytes(14695981039346656037ULL, src->data, src->len);
+    h = hash_bytes(h, cc, strlen(cc) + 1);
+    return hash_bytes(h, cpu, strlen(cpu));
+}
+
+/*
+   The directory the kernels are kept in, which has to be a directory of
+   our own that nobody else can write, or else someone could plant a
+   library in it that we load. Returns 0 and prints why otherwise.
+*/
+static int cache_dir(char *dir, size_t n)
+{
+    const char *env = getenv("CNN_JIT_DIR"),
+               *xdg = getenv("XDG_CACHE_HOME"),
+               *home = getenv("HOME");
+
+    if (env && *env)
+    {
+        snprintf(dir, n, "%s", env);
+    }
+    else if (xdg && *xdg)
+    {
+        snprintf(dir, n, "%s/pycnn", xdg);
+    }
+    else if (home && *home)
+    {
+        snprintf(dir, n, "%s/.cache", home);
+        mkdir(dir, 0700);
+        snprintf(dir, n, "%s/.cache/pycnn", home);
+    }
+    else
+    {
+        snprintf(dir, n, "/tmp/pycnn-%ld", (long) getuid());
+    }
+    mkdir(dir, 0700);
+
+    struct stat st;
+    if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0)
+    {
+        fprintf(stderr, "%s is not a private directory of this user, templates are not compiled\n", dir);
+        return 0;
+    }
+    return 1;
+}
+
+static const char *jit_flags[] = {"-O3", "-march=native", "-fopenmp-simd", "-fPIC", "-shared"};
+
+/* Runs $CC, split into words, on c_file without a shell; its messages are dropped. */
+static int run_compiler(const char *out, const char *c_file)
+{
+    char words[4096];
+    snprintf(words, sizeof(words), "%s", compiler());
+
+    char *argv[64], *save;
+    size_t argc = 0;
+    for (char *w = strtok_r(words, " \t\n", &save); w && argc < 48; w = strtok_r(NULL, " \t\n", &save))
+    {
+        argv[argc++] = w;
+    }
+    if (argc == 0)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i<sizeof(jit_flags)/sizeof(jit_flags[0]); ++i)
+    {
+        argv[argc++] = (char*) jit_flags[i];
+    }
+    argv[argc++] = "-o";
+    argv[argc++] = (char*) out;
+    argv[argc++] = (char*) c_file;
+    argv[argc] = NULL;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+    pid_t pid;
+    int status;
+    const int ok = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ) == 0 &&
+                   waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    posix_spawn_file_actions_destroy(&actions);
+    return ok;
+}
+
+/*
+   Builds the shared object for src unless it is already there. Every
+   process compiles to its own file and renames it into place, so
+   concurrent compilations of the same kernel don't clash.
+*/
+static jit_kernel load_kernel(const source *src, uint64_t h)
+{
+    char dir[4096], so[4200], tmp[4300];
+    if (!cache_dir(dir, sizeof(dir)))
+    {
+        return NULL;
+    }
+    snprintf(so, sizeof(so), "%s/cnn_%016llx.so", dir, (unsigned long long) h);
+
+    if (access(so, R_OK) != 0)
+    {
+        snprintf(tmp, sizeof(tmp), "%s/cnn_%016llx.%ld", dir, (unsigned long long) h, (long) getpid());
+        char c_file[4400];
+        snprintf(c_file, sizeof(c_file), "%s.c", tmp);
+
+        FILE *f = fopen(c_file, "w");
+        if (!f)
+        {
+            return NULL;
+        }
+        fwrite(src->data, 1, src->len, f);
+        fclose(f);
+
+        const int ok = run_compiler(tmp, c_file) && rename(tmp, so) == 0;
+        remove(c_file);
+        if (!ok)
+        {
+            remove(tmp);
+            return NULL;
+        }
+    }
+
+    /* the library stays loaded, kernels are looked up again by later runs */
+    void *lib = dlopen(so, RTLD_NOW | RTLD_LOCAL);
+    if (!lib)
+    {
+        return NULL;
+    }
+
+    jit_kernel k;
+    *(void**) &k = dlsym(lib, "cnn_kernel");
+    return k;
+}
+
+typedef struct
+{
+    uint64_t hash;
+    jit_kernel kernel;
+} cache_entry;
+
+static cache_entry *cache = NULL;
+static size_t cache_len = 0;
+
+jit_kernel jit_compile(const template3x3 *tmpl, int nonlinear)
+{
+    source src = {NULL, 0, 0};
+    if (!generate(&src, tmpl, nonlinear))
+    {
+        free(src.data);
+        return NULL;
+    }
+    const uint64_t h = hash_kernel(&src);
+
+    jit_kernel k = NULL;
+    #pragma omp critical(cnn_jit)
+    {
+        size_t i = 0;
+        while (i<cache_len && cache[i].hash != h)
+        {
+            ++i;
+        }
+
+        if (i<cache_len)
+        {
+            k = cache[i].kernel;
+        }
+        else
+        {
+            /* failures are remembered too, so a missing compiler is only tried once per kernel */
+            k = load_kernel(&src, h);
+            cache = (cache_entry*) realloc(cache, sizeof(cache_entry)*(cache_len+1));
+            cache[cache_len].hash = h;
+            cache[cache_len].kernel = k;
+            ++cache_len;
+        }
+    }
+
+    free(src.data);
+    return k;
+}
@@ -0,0 +1,37 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#ifndef CNN_JIT_H
+#define CNN_JIT_H
+
+#include "cnn.h"
+#include "stencil.h"
+
+/*
+   Kernels specialized to one 3x3 template. The A and D parts are written
+   out as C with the coefficients as literals: zero terms are left out,
+   neighbors sharing a coefficient are summed before the multiplication and
+   the nonlinearities are inlined. The source is compiled with the system
+   compiler ($CC, or cc) into $CNN_JIT_DIR, or ~/.cache/pycnn by default,
+   and loaded from there; kernels are looked up by the hash of their
+   source, the compiler and the CPU, in memory and on disk, so each
+   template is compiled only once per machine. The directory has to belong
+   to the user and be closed to others, or nothing is compiled.
+
+   NULL is returned when the template uses a nonlinearity other than the
+   built-in ones or when compiling fails, and the caller falls back to the
+   generic evaluation.
+*/
+jit_kernel jit_compile(const template3x3 *tmpl, int nonlinear);
+
+#endif
@@ -0,0 +1,172 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include "pool.h"
+
+/*
+   Every block starts with a header of POOL_ALIGN bytes holding its size
+   class, so blocks are freed without knowing their size, and the data
+   after it stays aligned. Small sizes are rounded up to the alignment,
+   large ones to pages, so planes of one frame size share a class.
+*/
+static size_t size_class(size_t bytes)
+{
+    const size_t unit = bytes < 65536 ? POOL_ALIGN : 4096;
+    return (bytes + unit-1)/unit*unit + (bytes == 0)*unit;
+}
+
+/*
+   No caller can go on without the memory it asked for, and most of them
+   run inside parallel loops, so running out of it ends the process here.
+*/
+static void *checked(void *p, size_t bytes)
+{
+    if (!p)
+    {
+        fprintf(stderr, "out of memory allocating %zu bytes\n", bytes);
+        abort();
+    }
+    return p;
+}
+
+static void *kept[POOL_SLOTS];
+static size_t nkept = 0,
+              kept_bytes = 0;
+
+void *pool_alloc(size_t bytes)
+{
+    const size_t cls = size_class(bytes);
+    unsigned char *block = NULL;
+
+    #pragma omp critical(cnn_pool)
+    {
+        for (size_t i = nkept; i>0; --i)
+        {
+            if (*(size_t*) kept[i-1] == cls)
+            {
+                block = (unsigned char*) kept[i-1];
+                memmove(kept + i-1, kept + i, sizeof(void*)*(nkept - i));
+                --nkept;
+                kept_bytes -= cls;
+                break;
+            }
+        }
+    }
+
+    if (!block)
+    {
+        block = (unsigned char*) checked(aligned_alloc(POOL_ALIGN, POOL_ALIGN + cls), POOL_ALIGN + cls);
+        *(size_t*) block = cls;
+    }
+
+    return block + POOL_ALIGN;
+}
+
+void pool_free(void *p)
+{
+    if (!p)
+    {
+        return;
+    }
+
+    void *block = (unsigned char*) p - POOL_ALIGN;
+    const size_t cls = *(size_t*) block;
+    if (cls > POOL_BYTES)
+    {
+        free(block);
+        return;
+    }
+
+    /* the evicted blocks are freed outside the lock */
+    void *evicted[POOL_SLOTS];
+    size_t nevicted = 0;
+
+    #pragma omp critical(cnn_pool)
+    {
+        while (nkept == POOL_SLOTS || kept_bytes + cls > POOL_BYTES)
+        {
+            evicted[nevicted++] = kept[0];
+            kept_bytes -= *(size_t*) kept[0];
+            memmove(kept, kept + 1, sizeof(void*)*(nkept-1));
+            --nkept;
+        }
+        kept[nkept++] = block;
+        kept_bytes += cls;
+    }
+
+    for (size_t i = 0; i<nevicted; ++i)
+    {
+        free(evicted[i]);
+    }
+}
+
+void pool_release()
+{
+    #pragma omp critical(cnn_pool)
+    {
+        for (size_t i = 0; i<nkept; ++i)
+        {
+            free(kept[i]);
+        }
+        nkept = 0;
+        kept_bytes = 0;
+    }
+}
+
+typedef struct
+{
+    void *data[SCRATCH_SLOTS];
+    size_t size[SCRATCH_SLOTS];
+} scratch_set;
+
+static tss_t scratch_key;
+static once_flag scratch_once = ONCE_FLAG_INIT;
+
+static void free_scratch(void *p)
+{
+    scratch_set *s = (scratch_set*) p;
+    for (int i = 0; i<SCRATCH_SLOTS; ++i)
+    {
+        free(s->data[i]);
+    }
+    free(s);
+}
+
+static void create_scratch_key()
+{
+    tss_create(&scratch_key, free_scratch);
+}
+
+void *pool_scratch(int slot, size_t bytes)
+{
+    call_once(&scratch_once, create_scratch_key);
+    scratch_set *s = (scratch_set*) tss_get(scratch_key);
+    if (!s)
+    {
+        s = (scratch_set*) checked(calloc(1, sizeof(scratch_set)), sizeof(scratch_set));
+        tss_set(scratch_key, s);
+    }
+
+    if (s->size[slot] < bytes)
+    {
+        free(s->data[slot]);
+        s->size[slot] = size_class(bytes);
+        s->data[slot] = checked(aligned_alloc(POOL_ALIGN, s->size[slot]), s->size[slot]);
+    }
+
+    return s->data[slot];
+}
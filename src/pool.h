@@ -0,0 +1,54 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#ifndef CNN_POOL_H
+#define CNN_POOL_H
+
+#include <stddef.h>
+
+/* Alignment of every block, a cache line and an AVX-512 vector. */
+#define POOL_ALIGN 64
+
+/*
+   How many freed blocks, and how many bytes of them, are kept at most; the
+   oldest ones go first. The bytes are enough for the planes of a run on a
+   few 4K frames, not for those of every frame size a process has seen.
+*/
+#define POOL_SLOTS 256
+#define POOL_BYTES ((size_t) 1 << 30)
+
+/*
+   Storage for matrices and other planes. Freed blocks are kept by size
+   and handed out again, so simulations run over and over on frames of the
+   same size allocate nothing after the first one, and the pages of large
+   planes stay mapped instead of being returned to the system and faulted
+   in again on every run. The pool is shared by all threads. If the system
+   is out of memory, pool_alloc and pool_scratch print a message and abort.
+*/
+void *pool_alloc(size_t bytes);
+void pool_free(void *p);
+void pool_release();
+
+/*
+   Scratch buffers for the row rings of the evaluators, one set per thread,
+   kept from call to call and grown when needed. Code that may run while a
+   buffer is in use takes another slot.
+*/
+#define SCRATCH_LINEAR 0
+#define SCRATCH_NONLINEAR 1
+#define SCRATCH_COMPACT 2
+#define SCRATCH_SLOTS 3
+
+void *pool_scratch(int slot, size_t bytes);
+
+#endif
@@ -12,107 +12,190 @@
 */
 
 #include "pycnn.h"
+#include "stream.h"
+#include "tiled.h"
+#include "distributed.h"
 #include <SDL.h>
 
-template3x3 tem3x3;
-void *tem_data;
-double (*tem_func)(size_t, size_t, matrix, matrix, matrix, double, void*);
-matrix init;
-matrix input1;
-matrix input2;
-double bnd;
-size_t s;
+cnn_context *py_create_context()
+{
+    cnn_context *ctx = (cnn_context*) calloc(1, sizeof(cnn_context));
+    ctx->s = 1;
+    ctx->solver = SOLVER_RK4;
+    ctx->opt.tol = 1e-3;
+    ctx->opt.block_steps = 1;
+    ctx->opt.precision = PRECISION_DOUBLE;
+    ctx->opt.conv = NOCONV;
+    ctx->preview_every = 1;
+    ctx->preview_fps = 30;
+    return ctx;
+}
 
-SDL_Window *window = NULL;
+void py_free_context(cnn_context *ctx)
+{
+    if (ctx->window)
+    {
+        SDL_DestroyWindow(ctx->window);
+    }
+    free(ctx);
+}
 
-matrix py_load_image(const char *file)
+matrix py_load_image(const char *file, size_t s)
 {
-    matrix mat = load_image(file);
-    matrix res = expand_matrix(mat, 1);
-    free_matrix(mat);
-    return res;
+    return load_image(file, s);
 }
 
-void py_set_template3x3(template3x3 tm)
+void py_set_template3x3(cnn_context *ctx, template3x3 tm)
 {
-    tem3x3 = tm;
-    tem_data = &tem3x3;
-    s = 1;
+    ctx->tem3x3 = tm;
+    ctx->tem_data = &ctx->tem3x3;
+    ctx->s = 1;
 
     for (int i = 0; i<9; ++i)
     {
         if (tm.d[i] != 0)
         {
-            tem_func = nonlinear3x3;
+            ctx->tem_func = nonlinear3x3;
             return;
         }
     }
-    tem_func = linear3x3;
+    ctx->tem_func = linear3x3;
 }
 
-void py_set_template_custom(double (*tem)(size_t, size_t, matrix, matrix, matrix, double, void*), size_t s_val)
+void py_set_templatenxn(cnn_context *ctx, templatenxn tm)
 {
-    tem_func = tem;
-    tem_data = NULL;
-    s = s_val;
+    ctx->temnxn = tm;
+    ctx->tem_data = &ctx->temnxn;
+    ctx->s = tm.r;
+
+    const size_t k = 2*tm.r + 1;
+    for (size_t i = 0; i<k*k; ++i)
+    {
+        if (tm.d[i] != 0)
+        {
+            ctx->tem_func = nonlinearnxn;
+            return;
+        }
+    }
+    ctx->tem_func = linearnxn;
 }
 
-void py_set_boundary(double b)
+void py_set_template_custom(cnn_context *ctx, double (*tem)(size_t, size_t, matrix, matrix, matrix, double, void*), size_t s_val)
 {
-    bnd = b;
+    ctx->tem_func = tem;
+    ctx->tem_data = NULL;
+    ctx->s = s_val;
 }
 
-void py_set_init(matrix m)
+void py_set_boundary(cnn_context *ctx, double b)
 {
-    init = m;
+    ctx->bnd = b;
 }
 
-void py_set_input1(matrix m)
+void py_set_solver(cnn_context *ctx, int method, double tolerance)
 {
-    input1 = m;
+    ctx->solver = method;
+    ctx->opt.tol = tolerance;
 }
 
-void py_set_input2(matrix m)
+void py_set_active_tolerance(cnn_context *ctx, double tolerance)
 {
-    input2 = m;
+    ctx->opt.active_tol = tolerance;
 }
 
-matrix py_apply_template(double dt, double t_end, int anim)
+void py_set_block_steps(cnn_context *ctx, size_t steps)
 {
-    fill_bounds(init, 1, bnd);
-    fill_bounds(input1, 1, bnd);
-    fill_bounds(input2, 1, bnd);
+    ctx->opt.block_steps = steps;
+}
 
-    void (*upd_func)(matrix, void*) = update_nothing;
-    void *upd_data = NULL;
+void py_set_precision(cnn_context *ctx, int p)
+{
+    ctx->opt.precision = p;
+}
 
-    if (anim & ANIMATE)
-    {
-        upd_func = update_animate;
-        if (!window)
-        {
-            window = SDL_CreateWindow("CNN", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-                                      init.w, init.h, SDL_WINDOW_SHOWN);
-        }
-        upd_data = window;
-    }
+void py_set_jit(cnn_context *ctx, int jit)
+{
+    ctx->opt.jit = jit;
+}
+
+void py_set_preview(cnn_context *ctx, size_t every, double fps)
+{
+    ctx->preview_every = every;
+    ctx->preview_fps = fps;
+}
+
+void py_set_convergence(cnn_context *ctx, double eps, size_t stable_steps)
+{
+    ctx->opt.conv.eps = eps;
+    ctx->opt.conv.stable_steps = stable_steps;
+}
+
+run_info py_get_info(cnn_context *ctx)
+{
+    return ctx->info;
+}
+
+/* Everything the calling thread runs is profiled into the context until it's turned off. */
+void py_profile(cnn_context *ctx, int on)
+{
+    profile_into(on ? &ctx->stats : NULL);
+}
+
+cnn_stats py_get_stats(cnn_context *ctx)
+{
+    return ctx->stats;
+}
 
-    void (*bnd_func)(matrix, size_t) = NULL;
+static void (*bound_func(double bnd))(matrix, size_t)
+{
     if (bnd == ZEROFLUX)
     {
-        bnd_func = bound_zeroflux;
+        return bound_zeroflux;
     }
     else if (bnd == PERIODIC)
     {
-        bnd_func = bound_periodic;
+        return bound_periodic;
     }
     else
     {
-        bnd_func = bound_constant;
+        return bound_constant;
+    }
+}
+
+static void open_display(cnn_context *ctx, int anim, size_t w, size_t h,
+                         void (**upd_func)(matrix, void*), void **upd_data)
+{
+    *upd_func = update_nothing;
+    *upd_data = NULL;
+
+    if (anim & ANIMATE)
+    {
+        *upd_func = update_animate;
+        if (!ctx->window)
+        {
+            ctx->window = SDL_CreateWindow("CNN", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+                                           w, h, SDL_WINDOW_SHOWN);
+        }
+        *upd_data = ctx->window;
+
+        /* drawn by a thread of its own, which owns the renderer of the window */
+        ctx->preview = start_preview(ctx->window, w, h, ctx->preview_every, ctx->preview_fps);
+        if (ctx->preview)
+        {
+            *upd_func = update_preview;
+            *upd_data = ctx->preview;
+        }
+    }
+}
+
+/* last is shown until the window is closed. */
+static void close_display(cnn_context *ctx, int anim, matrix last)
+{
+    if (ctx->preview)
+    {
+        stop_preview(ctx->preview, last);
     }
 
-    matrix res = run_cnn(init, input1, input2, 1, tem_func, tem_data, bnd_func, dt, t_end, upd_func, upd_data);
-    
     if (anim & BLOCK && anim & ANIMATE)
     {
         SDL_Event ev;
@@ -126,11 +209,215 @@ matrix py_apply_template(double dt, double t_end, int anim)
         }
     }
 
+    if (ctx->preview)
+    {
+        free_preview(ctx->preview);
+        ctx->preview = NULL;
+    }
+
     if (anim & CLOSE_WINDOW && anim & ANIMATE)
     {
-        SDL_DestroyWindow(window);
-        window = NULL;
+        SDL_DestroyWindow(ctx->window);
+        ctx->window = NULL;
+    }
+}
+
+/*
+   planes holds the images the chain starts from, with a halo of s, followed
+   by a free slot for the output of every stage. The template, boundary,
+   time step and solver come from the stages, everything else from the
+   context. The output of the last stage is returned as it is, with its
+   boundary as the halo. An empty chain gives NULLMAT.
+*/
+matrix py_apply_chain(cnn_context *ctx, size_t n, const chain_stage *stages, matrix *planes, size_t nplanes,
+                      size_t s, run_info *info, int anim)
+{
+    if (n == 0)
+    {
+        return NULLMAT;
+    }
+
+    for (size_t i = 0; i<nplanes; ++i)
+    {
+        planes[i] = matrix_plane(planes[i]);
+    }
+
+    void (*upd_func)(matrix, void*);
+    void *upd_data;
+    const matrix first = planes[stages[0].init];
+    open_display(ctx, anim, first.w, first.h, &upd_func, &upd_data);
+
+    matrix res = run_chain(n, stages, planes, nplanes, s, ctx->opt, info, upd_func, upd_data);
+    matrix out = matrix_interior(res, s);
+    ctx->info = info[n-1];
+
+    close_display(ctx, anim, res);
+
+    return out;
+}
+
+/*
+   Runs a chain on every frame of the stream in, writing the results to
+   out. planes is laid out as for py_apply_chain, with the frame at
+   planes[frame] and the result of the previous frame at planes[warm], if
+   warm is a plane index. Returns the number of frames, or -1 if the chain
+   is empty, a stream can't be opened or the run fails.
+*/
+long py_apply_stream(cnn_context *ctx, size_t n, const chain_stage *stages, matrix *planes, size_t nplanes,
+                     size_t frame, size_t warm, size_t s, const char *in, int in_format, size_t w, size_t h,
+                     const char *out, int out_format, run_info *info)
+{
+    frame_stream src, dst;
+    if (n == 0 || !open_source(&src, in, in_format, w, h, s))
+    {
+        return -1;
+    }
+    if (!open_sink(&dst, out, out_format, &src))
+    {
+        close_stream(&src);
+        return -1;
+    }
+
+    for (size_t i = 0; i<nplanes; ++i)
+    {
+        planes[i] = matrix_plane(planes[i]);
+    }
+
+    const long frames = run_stream(&src, &dst, n, stages, planes, nplanes, frame, warm, s, ctx->opt, info);
+    ctx->info = info[n-1];
+
+    close_stream(&src);
+    close_stream(&dst);
+    return frames;
+}
+
+/*
+   Runs the template of the context on raw files of w x h samples, without
+   reading them into memory. input1 and input2 may be NULL for init.
+   Returns 0 if a file can't be mapped or the run can't be split.
+*/
+int py_apply_tiled(cnn_context *ctx, const char *init, const char *input1, const char *input2, int in_format,
+                   size_t w, size_t h, const char *out, int out_format, const char *scratch_dir,
+                   double dt, double t_end, size_t tile, size_t pass_steps)
+{
+    mapped_plane x = {0},
+                 u1 = {0},
+                 u2 = {0},
+                 res = {0};
+    int ok = map_plane(&x, init, in_format, w, h, 0) &&
+             (!input1 || map_plane(&u1, input1, in_format, w, h, 0)) &&
+             (!input2 || map_plane(&u2, input2, in_format, w, h, 0)) &&
+             map_plane(&res, out, out_format, w, h, 1);
+
+    if (ok)
+    {
+        const mapped_plane *in1 = input1 ? &u1 : &x,
+                           *in2 = input2 ? &u2 : in1;
+        ok = run_tiled(&x, in1, in2, &res, ctx->s, ctx->tem_func, ctx->tem_data, bound_func(ctx->bnd),
+                       ctx->bnd, dt, t_end, ctx->solver, ctx->opt, tile, pass_steps, scratch_dir, &ctx->info);
+    }
+
+    unmap_plane(&x);
+    unmap_plane(&u1);
+    unmap_plane(&u2);
+    unmap_plane(&res);
+    return ok;
+}
+
+/*
+   Like py_apply_tiled, but split between the processes started by mpirun,
+   every one of which has to call it. out may be NULL; the result is
+   gathered into gathered on rank 0 when that isn't NULL.
+*/
+int py_apply_distributed(cnn_context *ctx, const char *init, const char *input1, const char *input2,
+                         int in_format, size_t w, size_t h, const char *out, int out_format,
+                         matrix *gathered, double dt, double t_end)
+{
+    mapped_plane x = {0},
+                 u1 = {0},
+                 u2 = {0},
+                 res = {0};
+    int ok = map_plane(&x, init, in_format, w, h, 0) &&
+             (!input1 || map_plane(&u1, input1, in_format, w, h, 0)) &&
+             (!input2 || map_plane(&u2, input2, in_format, w, h, 0)) &&
+             (!out || map_plane(&res, out, out_format, w, h, 1));
+
+    /* the others would wait for a process that gave up forever */
+    if (distributed_all(ok))
+    {
+        const mapped_plane *in1 = input1 ? &u1 : &x,
+                           *in2 = input2 ? &u2 : in1;
+        ok = run_distributed(&x, in1, in2, out ? &res : NULL, gathered, ctx->s, ctx->tem_func, ctx->tem_data,
+                             bound_func(ctx->bnd), ctx->bnd, dt, t_end, ctx->solver, ctx->opt, &ctx->info);
+    }
+    else
+    {
+        ok = 0;
+    }
+
+    unmap_plane(&x);
+    unmap_plane(&u1);
+    unmap_plane(&u2);
+    unmap_plane(&res);
+    return ok;
+}
+
+/* m as a plane padded by s, copied only if its halo doesn't fit */
+static matrix padded_plane(matrix m, size_t s, double bnd)
+{
+    const int fits = m.halo == s && m.stride == m.w + 2*s;
+    const matrix plane = matrix_plane(fits ? m : pad_matrix(m, s));
+    fill_bounds(plane, s, bnd);
+    return plane;
+}
+
+/* frees plane if padded_plane made it for m */
+static void release_plane(matrix plane, matrix m)
+{
+    if (plane.data != matrix_plane(m).data)
+    {
+        free_matrix(plane);
+    }
+}
+
+/*
+   Images with a halo of s are simulated in place, their halo overwritten;
+   the others are padded here, in parallel, instead of once per image on
+   the Python side. The results have their boundary as the halo.
+*/
+void py_apply_template_batch(cnn_context *ctx, size_t n, const matrix *init, const matrix *input1,
+                             const matrix *input2, matrix *out, run_info *info, double dt, double t_end)
+{
+    matrix *x = (matrix*) malloc(sizeof(matrix)*4*n),
+           *u1 = x + n,
+           *u2 = x + 2*n,
+           *res = x + 3*n;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i<n; ++i)
+    {
+        x[i] = padded_plane(init[i], ctx->s, ctx->bnd);
+        u1[i] = input1[i].data != init[i].data ? padded_plane(input1[i], ctx->s, ctx->bnd) : x[i];
+        u2[i] = input2[i].data != init[i].data ? padded_plane(input2[i], ctx->s, ctx->bnd) : x[i];
+    }
+
+    run_cnn_batch(n, x, u1, u2, res, ctx->s, ctx->tem_func, ctx->tem_data, bound_func(ctx->bnd),
+                  dt, t_end, ctx->solver, ctx->opt, info);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i<n; ++i)
+    {
+        out[i] = matrix_interior(res[i], ctx->s);
+        if (u1[i].data != x[i].data)
+        {
+            release_plane(u1[i], input1[i]);
+        }
+        if (u2[i].data != x[i].data)
+        {
+            release_plane(u2[i], input2[i]);
+        }
+        release_plane(x[i], init[i]);
     }
 
-    return res;
+    free(x);
 }
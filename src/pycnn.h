@@ -15,6 +15,7 @@
 #define CNN_PYCNN_H
 
 #include "cnn.h"
+#include "display.h"
 
 #define CONSTANT(a) a
 #define ZEROFLUX 2.0
@@ -24,13 +25,59 @@
 #define BLOCK 2
 #define CLOSE_WINDOW 4
 
-matrix py_load_image(const char *file);
-void py_set_template3x3(template3x3 tmpl);
-void py_set_template_custom(double (*tem)(size_t, size_t, matrix, matrix, matrix, double, void*), size_t s_val);
-void py_set_boundary(double b);
-void py_set_init(matrix m);
-void py_set_input1(matrix m);
-void py_set_input2(matrix m);
-matrix py_apply_template(double dt, double t_end, int animate);
+/*
+   Everything a simulation is configured with. Contexts share no state, so
+   independent simulations can run at the same time on different threads,
+   one context each.
+*/
+typedef struct
+{
+    template3x3 tem3x3;
+    templatenxn temnxn;
+    void *tem_data;
+    double (*tem_func)(size_t, size_t, matrix, matrix, matrix, double, void*);
+    double bnd;
+    size_t s;
+    int solver;
+    run_options opt;
+    run_info info;
+    cnn_stats stats;
+    SDL_Window *window;
+    preview *preview;
+    size_t preview_every;
+    double preview_fps;
+} cnn_context;
+
+cnn_context *py_create_context();
+void py_free_context(cnn_context *ctx);
+
+matrix py_load_image(const char *file, size_t s);
+void py_set_template3x3(cnn_context *ctx, template3x3 tmpl);
+void py_set_templatenxn(cnn_context *ctx, templatenxn tmpl);
+void py_set_template_custom(cnn_context *ctx, double (*tem)(size_t, size_t, matrix, matrix, matrix, double, void*), size_t s_val);
+void py_set_boundary(cnn_context *ctx, double b);
+void py_set_solver(cnn_context *ctx, int method, double tolerance);
+void py_set_active_tolerance(cnn_context *ctx, double tolerance);
+void py_set_block_steps(cnn_context *ctx, size_t steps);
+void py_set_precision(cnn_context *ctx, int p);
+void py_set_jit(cnn_context *ctx, int jit);
+void py_set_preview(cnn_context *ctx, size_t every, double fps);
+void py_set_convergence(cnn_context *ctx, double eps, size_t stable_steps);
+run_info py_get_info(cnn_context *ctx);
+void py_profile(cnn_context *ctx, int on);
+cnn_stats py_get_stats(cnn_context *ctx);
+matrix py_apply_chain(cnn_context *ctx, size_t n, const chain_stage *stages, matrix *planes, size_t nplanes,
+                      size_t s, run_info *info, int anim);
+long py_apply_stream(cnn_context *ctx, size_t n, const chain_stage *stages, matrix *planes, size_t nplanes,
+                     size_t frame, size_t warm, size_t s, const char *in, int in_format, size_t w, size_t h,
+                     const char *out, int out_format, run_info *info);
+int py_apply_tiled(cnn_context *ctx, const char *init, const char *input1, const char *input2, int in_format,
+                   size_t w, size_t h, const char *out, int out_format, const char *scratch_dir,
+                   double dt, double t_end, size_t tile, size_t pass_steps);
+int py_apply_distributed(cnn_context *ctx, const char *init, const char *input1, const char *input2,
+                         int in_format, size_t w, size_t h, const char *out, int out_format,
+                         matrix *gathered, double dt, double t_end);
+void py_apply_template_batch(cnn_context *ctx, size_t n, const matrix *init, const matrix *input1,
+                            const matrix *input2, matrix *out, run_info *info, double dt, double t_end);
 
 #endif
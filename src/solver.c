@@ -0,0 +1,847 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include "solver.h"
+
+/* Dormand-Prince 5(4) tableau. The last row of a is also the 5th order solution. */
+static const double dp_c[7] = {0, 1.0/5, 3.0/10, 4.0/5, 8.0/9, 1, 1};
+static const double dp_a[7][6] =
+{
+    {0},
+    {1.0/5},
+    {3.0/40, 9.0/40},
+    {44.0/45, -56.0/15, 32.0/9},
+    {19372.0/6561, -25360.0/2187, 64448.0/6561, -212.0/729},
+    {9017.0/3168, -355.0/33, 46732.0/5247, 49.0/176, -5103.0/18656},
+    {35.0/384, 0, 500.0/1113, 125.0/192, -2187.0/6784, 11.0/84}
+};
+static const double dp_e[7] =
+{
+    71.0/57600, 0, -71.0/16695, 71.0/1920, -17253.0/339200, 22.0/525, -1.0/40
+};
+
+#define TILE_ACTIVE 1
+#define TILE_SYNCED 2
+
+static _Thread_local const halo_ops *halo;
+
+void exchange_halos(const halo_ops *ops)
+{
+    halo = ops;
+}
+
+const halo_ops *exchanging()
+{
+    return halo;
+}
+
+void bound_halo(matrix m, size_t s)
+{
+    halo->begin(m, s, halo->data);
+    halo->end(m, s, halo->data);
+}
+
+tile_set create_tile_set(size_t w, size_t h, size_t s, double tol)
+{
+    const size_t tw = TILE_WIDTH > s ? TILE_WIDTH : s,
+                 th = TILE_HEIGHT > s ? TILE_HEIGHT : s;
+    tile_set ts;
+    ts.nx = (w - 2*s + tw-1)/tw;
+    ts.ny = (h - 2*s + th-1)/th;
+    ts.tol = tol;
+
+    const size_t n = ts.nx*ts.ny;
+    ts.tiles = (rect*) malloc(sizeof(rect)*n);
+    ts.active = (size_t*) malloc(sizeof(size_t)*n);
+    ts.delta = (double*) calloc(n, sizeof(double));
+    ts.partial = (double*) calloc(n, sizeof(double));
+    ts.flags = (unsigned char*) malloc(n);
+    ts.nactive = n;
+
+    for (size_t ty = 0; ty<ts.ny; ++ty)
+    {
+        for (size_t tx = 0; tx<ts.nx; ++tx)
+        {
+            const size_t i = ty*ts.nx + tx;
+            const rect r =
+            {
+                s + tx*tw,
+                s + ty*th,
+                s + (tx+1)*tw < w-s ? s + (tx+1)*tw : w-s,
+                s + (ty+1)*th < h-s ? s + (ty+1)*th : h-s
+            };
+            ts.tiles[i] = r;
+            ts.active[i] = i;
+            ts.flags[i] = TILE_ACTIVE;
+        }
+    }
+
+    return ts;
+}
+
+void free_tile_set(tile_set *ts)
+{
+    free(ts->tiles);
+    free(ts->active);
+    free(ts->delta);
+    free(ts->partial);
+    free(ts->flags);
+}
+
+static void copy_rect(matrix dst, matrix src, rect r)
+{
+    for (size_t y = r.y0; y<r.y1; ++y)
+    {
+        memcpy(dst.data + y*dst.w + r.x0, src.data + y*src.w + r.x0, sizeof(double)*(r.x1 - r.x0));
+    }
+}
+
+integrator create_integrator(int method, double dt, double tol, double active_tol, matrix init, size_t s,
+                             void (*eval)(matrix, matrix, double, rect, void*), void *eval_data,
+                             void (*bnd)(matrix, size_t))
+{
+    integrator in = {method, dt, dt/100, tol, s, eval, eval_data, bnd,
+                     create_tile_set(init.w, init.h, s, active_tol),
+                     {copy_matrix(init), copy_matrix(init)}};
+    in.nk = method == SOLVER_RK45 ? 7 : 1;
+    in.fsal = 0;
+    in.block = 1;
+    in.wops = NULL;
+    in.blocks = NULL;
+    in.nblocks = 0;
+    in.stats = profiling();
+    in.halo = halo;
+    in.pending = 0;
+
+    for (int i = 0; i<in.nk; ++i)
+    {
+        in.k[i] = create_matrix(init.w, init.h);
+    }
+
+    return in;
+}
+
+void free_integrator(integrator *in)
+{
+    free_tile_set(&in->tiles);
+    free(in->blocks);
+    free_matrix(in->stage[0]);
+    free_matrix(in->stage[1]);
+    for (int i = 0; i<in->nk; ++i)
+    {
+        free_matrix(in->k[i]);
+    }
+}
+
+/*
+   Frozen tiles are not written by the stages, so before they are read as
+   neighbors every plane has to hold the state they were frozen in.
+*/
+static void sync_tiles(integrator *in, matrix x, matrix next)
+{
+    tile_set *ts = &in->tiles;
+    const size_t n = ts->nx*ts->ny;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i<n; ++i)
+    {
+        if (!ts->flags[i])
+        {
+            copy_rect(next, x, ts->tiles[i]);
+            copy_rect(in->stage[0], x, ts->tiles[i]);
+            copy_rect(in->stage[1], x, ts->tiles[i]);
+            ts->flags[i] = TILE_SYNCED;
+        }
+    }
+}
+
+/*
+   Measure how far each integrated tile moved and activate the tiles next to
+   the ones that moved more than tol. Neighbors wrap around the grid so that
+   periodic boundaries are covered too.
+*/
+static void update_tiles(integrator *in, matrix x, matrix next)
+{
+    tile_set *ts = &in->tiles;
+    const size_t n = ts->nx*ts->ny;
+
+    for (size_t i = 0; i<n; ++i)
+    {
+        if (!(ts->flags[i] & TILE_ACTIVE))
+        {
+            ts->delta[i] = 0;
+        }
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i<ts->nactive; ++i)
+    {
+        const size_t ti = ts->active[i];
+        const rect r = ts->tiles[ti];
+        double d = 0;
+        for (size_t y = r.y0; y<r.y1; ++y)
+        {
+            for (size_t c = r.x0; c<r.x1; ++c)
+            {
+                d = fmax(d, fabs(next.data[y*x.w + c] - x.data[y*x.w + c]));
+            }
+        }
+        ts->delta[ti] = d;
+    }
+
+    ts->nactive = 0;
+    for (size_t ty = 0; ty<ts->ny; ++ty)
+    {
+        for (size_t tx = 0; tx<ts->nx; ++tx)
+        {
+            int act = 0;
+            for (int dy = -1; dy<=1; ++dy)
+            {
+                for (int dx = -1; dx<=1; ++dx)
+                {
+                    const size_t ny = (ty + ts->ny + dy) % ts->ny,
+                                 nx = (tx + ts->nx + dx) % ts->nx;
+                    act |= ts->delta[ny*ts->nx + nx] > ts->tol;
+                }
+            }
+
+            const size_t i = ty*ts->nx + tx;
+            if (act)
+            {
+                ts->flags[i] = TILE_ACTIVE;
+                ts->active[ts->nactive++] = i;
+            }
+            else
+            {
+                ts->flags[i] &= ~TILE_ACTIVE;
+            }
+        }
+    }
+}
+
+static void update_rect(matrix next, matrix stage, matrix x, matrix k, double cn, double cs, int first, rect r)
+{
+    for (size_t y = r.y0; y<r.y1; ++y)
+    {
+        const size_t o = y*x.w;
+        double *restrict nr = next.data + o;
+        const double *restrict xr = x.data + o,
+                     *restrict kr = k.data + o;
+
+        if (first)
+        {
+            #pragma omp simd
+            for (size_t c = r.x0; c<r.x1; ++c)
+            {
+                nr[c] = xr[c] + cn*kr[c];
+            }
+        }
+        else
+        {
+            #pragma omp simd
+            for (size_t c = r.x0; c<r.x1; ++c)
+            {
+                nr[c] += cn*kr[c];
+            }
+        }
+
+        if (stage.data)
+        {
+            double *restrict sr = stage.data + o;
+            #pragma omp simd
+            for (size_t c = r.x0; c<r.x1; ++c)
+            {
+                sr[c] = xr[c] + cs*kr[c];
+            }
+        }
+    }
+}
+
+/* in->eval on r, counted for the threads when the run is profiled. */
+static void eval_rect(const integrator *in, matrix dx, matrix x, double t, rect r, void *data)
+{
+    if (!in->stats)
+    {
+        in->eval(dx, x, t, r, data);
+        return;
+    }
+
+    const double start = stats_clock();
+    in->eval(dx, x, t, r, data);
+    stats_work(in->stats, (r.x1 - r.x0)*(r.y1 - r.y0), start);
+}
+
+static void finish_halo(integrator *in, matrix x)
+{
+    in->halo->end(x, in->s, in->halo->data);
+    in->pending = 0;
+}
+
+static rect clip_rect(rect r, rect c)
+{
+    return (rect) {r.x0 > c.x0 ? r.x0 : c.x0, r.y0 > c.y0 ? r.y0 : c.y0,
+                   r.x1 < c.x1 ? r.x1 : c.x1, r.y1 < c.y1 ? r.y1 : c.y1};
+}
+
+/*
+   While the halo of src is being filled, the cells more than s away from it
+   are done first, and the strips along the edges once it is complete.
+*/
+static void overlap_pass(integrator *in, matrix src, double t, matrix x, matrix next,
+                         matrix stage, double cn, double cs, int first)
+{
+    const tile_set *ts = &in->tiles;
+    const size_t s = in->s,
+                 w = src.w,
+                 h = src.h;
+    const rect inner = {2*s, 2*s, w-2*s, h-2*s},
+               edges[4] =
+               {
+                   {s, s, w-s, 2*s},
+                   {s, h-2*s, w-s, h-s},
+                   {s, 2*s, 2*s, h-2*s},
+                   {w-2*s, 2*s, w-s, h-2*s}
+               };
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i<ts->nactive; ++i)
+    {
+        const rect r = clip_rect(ts->tiles[ts->active[i]], inner);
+        if (r.x0 < r.x1 && r.y0 < r.y1)
+        {
+            eval_rect(in, in->k[0], src, t, r, in->eval_data);
+            update_rect(next, stage, x, in->k[0], cn, cs, first, r);
+        }
+    }
+
+    finish_halo(in, src);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i<ts->nactive; ++i)
+    {
+        for (int j = 0; j<4; ++j)
+        {
+            const rect r = clip_rect(ts->tiles[ts->active[i]], edges[j]);
+            if (r.x0 < r.x1 && r.y0 < r.y1)
+            {
+                eval_rect(in, in->k[0], src, t, r, in->eval_data);
+                update_rect(next, stage, x, in->k[0], cn, cs, first, r);
+            }
+        }
+    }
+}
+
+/*
+   Evaluate the derivative on src and fold it into next and the following
+   stage, one tile at a time so the derivative is still in cache when it is
+   used. src and stage must be different planes: the tiles are processed in
+   parallel and read their neighbors from src.
+*/
+static void stage_pass(integrator *in, matrix src, double t, matrix x, matrix next,
+                       matrix stage, double cn, double cs, int first)
+{
+    const tile_set *ts = &in->tiles;
+    if (in->pending)
+    {
+        overlap_pass(in, src, t, x, next, stage, cn, cs, first);
+        return;
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i<ts->nactive; ++i)
+    {
+        const rect r = ts->tiles[ts->active[i]];
+        eval_rect(in, in->k[0], src, t, r, in->eval_data);
+        update_rect(next, stage, x, in->k[0], cn, cs, first, r);
+    }
+}
+
+const scheme schemes[3] =
+{
+    {1, {0}, {1}, {0}},
+    {2, {0, 1}, {2, 2}, {1, 0}},
+    {4, {0, 2, 2, 1}, {6, 3, 3, 6}, {2, 2, 1, 0}}
+};
+
+/*
+   Every stage reads only x or one stage plane and writes only the other
+   one, so cells never see a neighbor that is half-way through a step and
+   the result does not depend on the number of threads.
+*/
+static void fixed_step(integrator *in, matrix x, matrix next, double t, double dt)
+{
+    const scheme *m = &schemes[in->method < SOLVER_RK45 ? in->method : SOLVER_RK4];
+    matrix src = x;
+
+    for (int i = 0; i<m->n; ++i)
+    {
+        const matrix stage = i+1 < m->n ? in->stage[i%2] : NULLMAT;
+        stage_pass(in, src, m->at[i] ? t + dt/m->at[i] : t, x, next, stage,
+                   dt/m->weight[i], m->ahead[i] ? dt/m->ahead[i] : 0, i == 0);
+        if (stage.data)
+        {
+            integrator_bound(in, stage);
+        }
+        src = stage;
+    }
+}
+
+static void eval_pass(integrator *in, matrix dx, matrix src, double t)
+{
+    const tile_set *ts = &in->tiles;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i<ts->nactive; ++i)
+    {
+        eval_rect(in, dx, src, t, ts->tiles[ts->active[i]], in->eval_data);
+    }
+}
+
+static void combine_pass(integrator *in, matrix out, matrix x, const double *c, int n, double h)
+{
+    const tile_set *ts = &in->tiles;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i<ts->nactive; ++i)
+    {
+        const rect r = ts->tiles[ts->active[i]];
+        for (size_t y = r.y0; y<r.y1; ++y)
+        {
+            for (size_t col = r.x0; col<r.x1; ++col)
+            {
+                const size_t o = y*x.w + col;
+                double sum = 0;
+                for (int j = 0; j<n; ++j)
+                {
+                    sum += c[j]*in->k[j].data[o];
+                }
+                out.data[o] = x.data[o] + h*sum;
+            }
+        }
+    }
+}
+
+/*
+   RMS of the scaled error over the integrated cells. Partial sums are kept
+   per tile and added up in a fixed order, so the accepted steps do not
+   depend on the number of threads.
+*/
+static double rk45_error(integrator *in, matrix x, matrix y, double h)
+{
+    tile_set *ts = &in->tiles;
+    const double tol = in->tol;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i<ts->nactive; ++i)
+    {
+        const rect r = ts->tiles[ts->active[i]];
+        double err = 0;
+        for (size_t row = r.y0; row<r.y1; ++row)
+        {
+            for (size_t col = r.x0; col<r.x1; ++col)
+            {
+                const size_t o = row*x.w + col;
+                double e = 0;
+                for (int j = 0; j<7; ++j)
+                {
+                    e += dp_e[j]*in->k[j].data[o];
+                }
+                const double scale = tol + tol*fmax(fabs(x.data[o]), fabs(y.data[o]));
+                err += (h*e/scale)*(h*e/scale);
+            }
+        }
+        ts->partial[i] = err;
+    }
+
+    double err = 0;
+    size_t cells = 0;
+    for (size_t i = 0; i<ts->nactive; ++i)
+    {
+        const rect r = ts->tiles[ts->active[i]];
+        err += ts->partial[i];
+        cells += (r.x1 - r.x0)*(r.y1 - r.y0);
+    }
+
+    return cells ? sqrt(err/cells) : 0;
+}
+
+/*
+   Embedded Dormand-Prince step with error control. Rejected steps are
+   retried with a smaller h; the step that is finally taken is returned and
+   in->h is set to the size proposed for the next one. Templates with a
+   discontinuous nonlinearity never meet the tolerance at a switching cell,
+   so steps are not allowed to shrink below h_min.
+*/
+static double rk45_step(integrator *in, matrix x, matrix next, double t, double t_end)
+{
+    if (!in->fsal)
+    {
+        eval_pass(in, in->k[0], x, t);
+    }
+
+    while (1)
+    {
+        const double h = fmin(in->h, t_end - t);
+
+        for (int i = 1; i<7; ++i)
+        {
+            /* the last stage is the 5th order solution itself */
+            matrix out = i == 6 ? next : in->stage[0];
+            combine_pass(in, out, x, dp_a[i], i, h);
+            in->bnd(out, in->s);
+            eval_pass(in, in->k[i], out, t + dp_c[i]*h);
+        }
+
+        const double err = rk45_error(in, x, next, h);
+        const double factor = err == 0 ? 5 : fmin(5, fmax(0.2, 0.9*pow(err, -0.2)));
+
+        if (err <= 1 || h <= in->h_min)
+        {
+            /*
+               first same as last: k7 is the derivative at the start of the
+               next step, unless the next step integrates different tiles
+            */
+            matrix tmp = in->k[0];
+            in->k[0] = in->k[6];
+            in->k[6] = tmp;
+            in->fsal = in->tiles.tol == 0;
+
+            in->h = fmax(h*factor, in->h_min);
+            return h;
+        }
+
+        in->h = fmax(h*factor, in->h_min);
+    }
+}
+
+/*
+   Temporal blocking: a block of the grid is copied into a private window
+   that is wide enough to advance it several steps without talking to its
+   neighbors. Each evaluation invalidates s more cells along every side of
+   the window, so after n steps of an m stage method the valid part has
+   shrunk by n*m*s, which is exactly the block.
+
+   Outside the interior the window follows the boundary condition: with
+   periodic boundaries it simply wraps around and every cell evolves, with
+   zero-flux boundaries the halo is copied from the nearest interior cells
+   after every stage, and with constant boundaries the halo never changes.
+*/
+typedef struct
+{
+    ptrdiff_t x0, y0;
+    size_t w, h;
+    int left, top, right, bottom;
+} window;
+
+static size_t window_map(ptrdiff_t g, size_t s, size_t n, int periodic)
+{
+    if (!periodic)
+    {
+        return g;
+    }
+    const ptrdiff_t len = n - 2*s,
+                    i = ((g - (ptrdiff_t) s) % len + len) % len;
+    return s + i;
+}
+
+static window make_window(rect tile, size_t margin, size_t w, size_t h, int periodic)
+{
+    window win;
+    win.x0 = (ptrdiff_t) tile.x0 - margin;
+    win.y0 = (ptrdiff_t) tile.y0 - margin;
+    ptrdiff_t x1 = tile.x1 + margin,
+              y1 = tile.y1 + margin;
+
+    win.left = win.top = win.right = win.bottom = 0;
+    if (!periodic)
+    {
+        win.left = win.x0 <= 0;
+        win.top = win.y0 <= 0;
+        win.right = x1 >= (ptrdiff_t) w;
+        win.bottom = y1 >= (ptrdiff_t) h;
+        win.x0 = win.left ? 0 : win.x0;
+        win.y0 = win.top ? 0 : win.y0;
+        x1 = win.right ? (ptrdiff_t) w : x1;
+        y1 = win.bottom ? (ptrdiff_t) h : y1;
+    }
+    win.w = x1 - win.x0;
+    win.h = y1 - win.y0;
+
+    return win;
+}
+
+static void window_bound(matrix m, const window *win, size_t s)
+{
+    for (size_t i = 0; i<s; ++i)
+    {
+        if (win->top)
+        {
+            memcpy(m.data + i*m.w, m.data + s*m.w, sizeof(double)*m.w);
+        }
+        if (win->bottom)
+        {
+            memcpy(m.data + (m.h-1-i)*m.w, m.data + (m.h-1-s)*m.w, sizeof(double)*m.w);
+        }
+    }
+
+    for (size_t y = 0; y<m.h; ++y)
+    {
+        double *row = m.data + y*m.w;
+        for (size_t i = 0; i<s; ++i)
+        {
+            if (win->left)
+            {
+                row[i] = row[s];
+            }
+            if (win->right)
+            {
+                row[m.w-1-i] = row[m.w-1-s];
+            }
+        }
+    }
+}
+
+static rect window_rect(const window *win, size_t margin, size_t s)
+{
+    const rect r =
+    {
+        win->left ? s : margin,
+        win->top ? s : margin,
+        win->right ? win->w - s : win->w - margin,
+        win->bottom ? win->h - s : win->h - margin
+    };
+    return r;
+}
+
+static void block_tile(integrator *in, matrix x, matrix next, rect tile, double t, size_t steps,
+                       matrix *p, size_t *mx, size_t *my, void *local)
+{
+    const scheme *m = &schemes[in->method];
+    const size_t s = in->s;
+    const int periodic = in->bnd == bound_periodic,
+              zeroflux = in->bnd == bound_zeroflux;
+    const window win = make_window(tile, steps*m->n*s, x.w, x.h, periodic);
+
+    matrix xw = {win.w, win.h, p[0].data, win.w},
+           nw = {win.w, win.h, p[1].data, win.w},
+           sw[2] = {{win.w, win.h, p[2].data, win.w}, {win.w, win.h, p[3].data, win.w}},
+           kw = {win.w, win.h, p[4].data, win.w};
+
+    for (size_t i = 0; i<win.w; ++i)
+    {
+        mx[i] = window_map(win.x0 + (ptrdiff_t) i, s, x.w, periodic);
+    }
+    for (size_t j = 0; j<win.h; ++j)
+    {
+        my[j] = window_map(win.y0 + (ptrdiff_t) j, s, x.h, periodic);
+        for (size_t i = 0; i<win.w; ++i)
+        {
+            xw.data[j*win.w + i] = x.data[my[j]*x.w + mx[i]];
+        }
+    }
+    memcpy(nw.data, xw.data, sizeof(double)*win.w*win.h);
+    memcpy(sw[0].data, xw.data, sizeof(double)*win.w*win.h);
+    memcpy(sw[1].data, xw.data, sizeof(double)*win.w*win.h);
+    in->wops->gather(local, in->eval_data, mx, my, win.w, win.h);
+
+    size_t evals = 0;
+    for (size_t n = 0; n<steps; ++n)
+    {
+        matrix src = xw;
+        for (int i = 0; i<m->n; ++i)
+        {
+            const rect r = window_rect(&win, ++evals*s, s);
+            const matrix stage = i+1 < m->n ? sw[i%2] : NULLMAT;
+            eval_rect(in, kw, src, m->at[i] ? t + in->h/m->at[i] : t, r, local);
+            update_rect(nw, stage, xw, kw, in->h/m->weight[i], m->ahead[i] ? in->h/m->ahead[i] : 0, i == 0, r);
+            if (stage.data && zeroflux)
+            {
+                window_bound(stage, &win, s);
+            }
+            src = stage;
+        }
+
+        matrix tmp = xw;
+        xw = nw;
+        nw = tmp;
+        if (zeroflux)
+        {
+            window_bound(xw, &win, s);
+        }
+        t += in->h;
+    }
+
+    for (size_t y = tile.y0; y<tile.y1; ++y)
+    {
+        memcpy(next.data + y*next.w + tile.x0,
+               xw.data + (y - win.y0)*win.w + (tile.x0 - win.x0),
+               sizeof(double)*(tile.x1 - tile.x0));
+    }
+}
+
+static void block_step(integrator *in, matrix x, matrix next, double t, size_t steps)
+{
+    const size_t margin = steps*schemes[in->method].n*in->s,
+                 side = BLOCK_TILE + 2*margin;
+
+    #pragma omp parallel
+    {
+        matrix p[5];
+        for (int i = 0; i<5; ++i)
+        {
+            p[i] = create_matrix(side, side);
+        }
+        size_t *mx = (size_t*) malloc(sizeof(size_t)*side),
+               *my = (size_t*) malloc(sizeof(size_t)*side);
+        void *local = in->wops->create(in->eval_data, side, side);
+
+        #pragma omp for schedule(dynamic)
+        for (size_t i = 0; i<in->nblocks; ++i)
+        {
+            block_tile(in, x, next, in->blocks[i], t, steps, p, mx, my, local);
+        }
+
+        in->wops->destroy(local);
+        free(mx);
+        free(my);
+        for (int i = 0; i<5; ++i)
+        {
+            free_matrix(p[i]);
+        }
+    }
+}
+
+void integrator_set_blocking(integrator *in, size_t steps, const window_ops *ops)
+{
+    const int builtin = in->bnd == bound_constant || in->bnd == bound_zeroflux ||
+                        in->bnd == bound_periodic;
+
+    if (steps < 2 || !ops || !builtin || in->method == SOLVER_RK45 || in->tiles.tol > 0)
+    {
+        return;
+    }
+
+    const rect all = {in->s, in->s, in->stage[0].w - in->s, in->stage[0].h - in->s};
+    const size_t nx = (all.x1 - all.x0 + BLOCK_TILE-1)/BLOCK_TILE,
+                 ny = (all.y1 - all.y0 + BLOCK_TILE-1)/BLOCK_TILE;
+
+    in->block = steps;
+    in->wops = ops;
+    in->nblocks = nx*ny;
+    in->blocks = (rect*) malloc(sizeof(rect)*nx*ny);
+    for (size_t ty = 0; ty<ny; ++ty)
+    {
+        for (size_t tx = 0; tx<nx; ++tx)
+        {
+            const rect r =
+            {
+                all.x0 + tx*BLOCK_TILE,
+                all.y0 + ty*BLOCK_TILE,
+                all.x0 + (tx+1)*BLOCK_TILE < all.x1 ? all.x0 + (tx+1)*BLOCK_TILE : all.x1,
+                all.y0 + (ty+1)*BLOCK_TILE < all.y1 ? all.y0 + (ty+1)*BLOCK_TILE : all.y1
+            };
+            in->blocks[ty*nx + tx] = r;
+        }
+    }
+}
+
+size_t integrator_step(integrator *in, matrix x, matrix next, double *t, double t_end)
+{
+    const int sparse = in->tiles.tol > 0;
+
+    if (in->block > 1)
+    {
+        /* count the steps the same way a plain t += dt loop would */
+        size_t steps = 0;
+        double te = *t;
+        while (te<t_end && steps<in->block)
+        {
+            te += in->h;
+            ++steps;
+        }
+        if (steps > 1)
+        {
+            block_step(in, x, next, *t, steps);
+            *t = te;
+            return steps;
+        }
+    }
+
+    if (sparse)
+    {
+        sync_tiles(in, x, next);
+    }
+
+    if (in->method == SOLVER_RK45)
+    {
+        *t += rk45_step(in, x, next, *t, t_end);
+    }
+    else
+    {
+        fixed_step(in, x, next, *t, in->h);
+        *t += in->h;
+    }
+
+    if (sparse)
+    {
+        update_tiles(in, x, next);
+    }
+
+    return 1;
+}
+
+/* Applies bnd to x, or starts the halo exchange and leaves it pending. */
+void integrator_bound(integrator *in, matrix x)
+{
+    if (!in->halo)
+    {
+        in->bnd(x, in->s);
+        return;
+    }
+
+    in->halo->begin(x, in->s, in->halo->data);
+    in->pending = 1;
+    /* only the passes of the fixed step methods over every tile overlap the exchange */
+    if (in->method == SOLVER_RK45 || in->block > 1 || in->tiles.tol > 0)
+    {
+        finish_halo(in, x);
+    }
+}
+
+/*
+   Return max |dx/dt| over the interior for a step of size h from x to next.
+   settled is set when every output was saturated and did not change.
+*/
+double grid_rate(matrix x, matrix next, size_t s, double h, int *settled)
+{
+    double rate = 0;
+    int moving = 0;
+
+    #pragma omp parallel for reduction(max:rate) reduction(|:moving)
+    for (size_t r = s; r<x.h-s; ++r)
+    {
+        for (size_t c = s; c<x.w-s; ++c)
+        {
+            const double a = x.data[r*x.w + c],
+                         b = next.data[r*x.w + c];
+            rate = fmax(rate, fabs(b - a));
+            moving |= fabs(a) < 1 || fabs(b) < 1 || (a < 0) != (b < 0);
+        }
+    }
+
+    *settled = !moving;
+    return rate/h;
+}
@@ -0,0 +1,143 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#ifndef CNN_SOLVER_H
+#define CNN_SOLVER_H
+
+#include "cnn.h"
+
+/*
+   Tiles are wide so rows stay long enough for SIMD and the hardware
+   prefetcher, and short enough that the planes touched by one stage (state,
+   stage, derivative, next state and the feedforward term) fit in L2.
+*/
+#define TILE_WIDTH 256
+#define TILE_HEIGHT 16
+
+/* Edge length of the blocks advanced several steps at once. */
+#define BLOCK_TILE 64
+
+/* A block of interior cells, [x0, x1) x [y0, y1). */
+typedef struct
+{
+    size_t x0, y0, x1, y1;
+} rect;
+
+/*
+   The fixed step methods only ever combine x with the derivative of the
+   previous stage, so they are described by the step fractions (as divisors
+   of dt) at which each stage is evaluated, added to the next state and
+   used to form the following stage. A zero divisor means no offset.
+*/
+typedef struct
+{
+    int n;
+    double at[4], weight[4], ahead[4];
+} scheme;
+
+extern const scheme schemes[3];
+
+/*
+   Engines that depend only on the state and on constant planes indexed like
+   it can be evaluated on a private window of the grid. create allocates a
+   local copy of the engine for windows of up to w x h cells, gather lays
+   out its planes for a w x h window from the grid cells the window columns
+   and rows map to.
+*/
+typedef struct
+{
+    void *(*create)(void *engine, size_t w, size_t h);
+    void (*gather)(void *local, void *engine, const size_t *mx, const size_t *my, size_t w, size_t h);
+    void (*destroy)(void *local);
+} window_ops;
+
+/*
+   The interior of the grid split into tiles. Only the tiles listed in
+   active are integrated. When tol is zero every tile is always active;
+   otherwise a tile stays active only while it or one of its neighbors
+   moved by more than tol during the previous step, and settled tiles are
+   frozen.
+*/
+typedef struct
+{
+    size_t nx, ny;
+    rect *tiles;
+    size_t *active;
+    size_t nactive;
+    double tol;
+    double *delta;
+    double *partial;
+    unsigned char *flags;
+} tile_set;
+
+tile_set create_tile_set(size_t w, size_t h, size_t s, double tol);
+void free_tile_set(tile_set *ts);
+
+/*
+   A halo that is filled by someone else, like that of a block of a grid
+   split between processes. begin starts filling the halo of a plane and end
+   waits until it is done, so the cells that don't reach the halo can be
+   evaluated in between. Integrators pick up the halo operations set for the
+   thread that creates them, and bound_halo is the bnd function that fills
+   the halo with them and waits for it.
+*/
+typedef struct
+{
+    void (*begin)(matrix, size_t, void*);
+    void (*end)(matrix, size_t, void*);
+    void *data;
+} halo_ops;
+
+void exchange_halos(const halo_ops *ops);
+const halo_ops *exchanging();
+void bound_halo(matrix m, size_t s);
+
+/*
+   Time integration over whole grids. eval computes the derivative of the
+   cells of x inside a rect into dx; the integrator owns the scratch planes
+   needed by the chosen method and reuses them for every step.
+*/
+typedef struct
+{
+    int method;
+    double h, h_min, tol;
+    size_t s;
+    void (*eval)(matrix, matrix, double, rect, void*);
+    void *eval_data;
+    void (*bnd)(matrix, size_t);
+    tile_set tiles;
+    matrix stage[2];
+    matrix k[7];
+    int nk;
+    int fsal;
+    size_t block;
+    const window_ops *wops;
+    rect *blocks;
+    size_t nblocks;
+    cnn_stats *stats;
+    const halo_ops *halo;
+    int pending;
+} integrator;
+
+integrator create_integrator(int method, double dt, double tol, double active_tol, matrix init, size_t s,
+                             void (*eval)(matrix, matrix, double, rect, void*), void *eval_data,
+                             void (*bnd)(matrix, size_t));
+void free_integrator(integrator *in);
+void integrator_set_blocking(integrator *in, size_t steps, const window_ops *ops);
+size_t integrator_step(integrator *in, matrix x, matrix next, double *t, double t_end);
+
+/* Apply the boundary of x before a step; a halo exchange is only started. */
+void integrator_bound(integrator *in, matrix x);
+double grid_rate(matrix x, matrix next, size_t s, double h, int *settled);
+
+#endif
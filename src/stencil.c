@@ -0,0 +1,649 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#include <string.h>
+#include <math.h>
+#include "stencil.h"
+#include "fft.h"
+#include "pool.h"
+
+SIMD_CLONES
+static void output_row(double *restrict y, const double *restrict x, size_t n)
+{
+    #pragma omp simd
+    for (size_t i = 0; i<n; ++i)
+    {
+        const double v = x[i];
+        y[i] = v < -1 ? -1 : (v > 1 ? 1 : v);
+    }
+}
+
+SIMD_CLONES
+static void feedforward_row(double *restrict bu, const double *restrict u0,
+                            const double *restrict u1, const double *restrict u2,
+                            const double *restrict b, double z, size_t n)
+{
+    const double b0 = b[0], b1 = b[1], b2 = b[2],
+                 b3 = b[3], b4 = b[4], b5 = b[5],
+                 b6 = b[6], b7 = b[7], b8 = b[8];
+
+    #pragma omp simd
+    for (size_t i = 0; i<n; ++i)
+    {
+        bu[i] = b0*u0[i-1] + b1*u0[i] + b2*u0[i+1] +
+                b3*u1[i-1] + b4*u1[i] + b5*u1[i+1] +
+                b6*u2[i-1] + b7*u2[i] + b8*u2[i+1] + z;
+    }
+}
+
+SIMD_CLONES
+static void linear_row(double *restrict dx, const double *restrict x,
+                       const double *restrict y0, const double *restrict y1,
+                       const double *restrict y2, const double *restrict bu,
+                       const double *restrict a, size_t n)
+{
+    const double a0 = a[0], a1 = a[1], a2 = a[2],
+                 a3 = a[3], a4 = a[4], a5 = a[5],
+                 a6 = a[6], a7 = a[7], a8 = a[8];
+
+    #pragma omp simd
+    for (size_t i = 0; i<n; ++i)
+    {
+        dx[i] = a0*y0[i-1] + a1*y0[i] + a2*y0[i+1] +
+                a3*y1[i-1] + a4*y1[i] + a5*y1[i+1] +
+                a6*y2[i-1] + a7*y2[i] + a8*y2[i+1] +
+                bu[i] - x[i];
+    }
+}
+
+SIMD_CLONES
+static void tap_row(double *restrict y, const double *restrict x, double c, size_t n)
+{
+    #pragma omp simd
+    for (size_t i = 0; i<n; ++i)
+    {
+        y[i] += c*x[i];
+    }
+}
+
+SIMD_CLONES
+static void difference_row(double *restrict y, const double *restrict a, const double *restrict b, size_t n)
+{
+    #pragma omp simd
+    for (size_t i = 0; i<n; ++i)
+    {
+        y[i] = a[i] - b[i];
+    }
+}
+
+linear_engine create_linear_engine(const template3x3 *tmpl, matrix input1, size_t s)
+{
+    linear_engine e = {1, tmpl->a, create_matrix(input1.w, input1.h), NULL, NULL, NULL, 0, NULL};
+    const size_t n = input1.w - 2*s;
+
+    #pragma omp parallel for
+    for (size_t y = s; y<input1.h-s; ++y)
+    {
+        const double *u = input1.data + y*input1.w + s;
+        feedforward_row(e.bu.data + y*e.bu.w + s, u - input1.w, u, u + input1.w,
+                        tmpl->b, tmpl->z, n);
+    }
+
+    return e;
+}
+
+/*
+   Splits the k x k matrix m into outer products, m[j*k + i] = sum of
+   cols[t*k + j]*rows[t*k + i], by repeatedly taking out the cross of the
+   largest remaining entry, and returns their number. This is exact for
+   matrices of low rank; at most k products are taken.
+*/
+static size_t factorize(const double *m, size_t k, double *cols, double *rows)
+{
+    double *res = (double*) malloc(sizeof(double)*k*k),
+           top = 0;
+    for (size_t i = 0; i<k*k; ++i)
+    {
+        res[i] = m[i];
+        top = fmax(top, fabs(m[i]));
+    }
+
+    size_t rank = 0;
+    while (rank < k)
+    {
+        size_t p = 0;
+        for (size_t i = 1; i<k*k; ++i)
+        {
+            p = fabs(res[i]) > fabs(res[p]) ? i : p;
+        }
+        if (fabs(res[p]) <= 1e-12*top)
+        {
+            break;
+        }
+
+        const size_t pj = p/k,
+                     pi = p%k;
+        double *c = cols + rank*k,
+               *r = rows + rank*k;
+        for (size_t j = 0; j<k; ++j)
+        {
+            c[j] = res[j*k + pi]/res[p];
+            r[j] = res[pj*k + j];
+        }
+        for (size_t j = 0; j<k; ++j)
+        {
+            for (size_t i = 0; i<k; ++i)
+            {
+                res[j*k + i] -= c[j]*r[i];
+            }
+        }
+        ++rank;
+    }
+
+    free(res);
+    return rank;
+}
+
+static size_t nonzeros(const double *m, size_t n)
+{
+    size_t nz = 0;
+    for (size_t i = 0; i<n; ++i)
+    {
+        nz += m[i] != 0;
+    }
+    return nz;
+}
+
+static void feedforward_direct(matrix bu, matrix input1, const templatenxn *tmpl, size_t s)
+{
+    const size_t r = tmpl->r,
+                 k = 2*r + 1,
+                 n = input1.w - 2*s;
+
+    #pragma omp parallel for
+    for (size_t y = s; y<input1.h-s; ++y)
+    {
+        double *row = bu.data + y*bu.w + s;
+        for (size_t i = 0; i<n; ++i)
+        {
+            row[i] = tmpl->z;
+        }
+        for (size_t j = 0; j<k; ++j)
+        {
+            const double *u = input1.data + (y+j-r)*input1.w + s-r;
+            for (size_t i = 0; i<k; ++i)
+            {
+                if (tmpl->b[j*k + i] != 0)
+                {
+                    tap_row(row, u + i, tmpl->b[j*k + i], n);
+                }
+            }
+        }
+    }
+}
+
+/* Each product of B is a horizontal pass over the rows of u, then a vertical one over the results. */
+static void feedforward_separable(matrix bu, matrix input1, const templatenxn *tmpl, size_t s,
+                                  size_t rank, const double *cols, const double *rows)
+{
+    const size_t r = tmpl->r,
+                 k = 2*r + 1,
+                 n = input1.w - 2*s;
+    matrix hor = create_matrix(input1.w, input1.h);
+
+    #pragma omp parallel for
+    for (size_t y = s; y<input1.h-s; ++y)
+    {
+        double *row = bu.data + y*bu.w + s;
+        for (size_t i = 0; i<n; ++i)
+        {
+            row[i] = tmpl->z;
+        }
+    }
+
+    for (size_t t = 0; t<rank; ++t)
+    {
+        #pragma omp parallel for
+        for (size_t y = s-r; y<input1.h-s+r; ++y)
+        {
+            double *h = hor.data + y*hor.w + s;
+            const double *u = input1.data + y*input1.w + s-r;
+            memset(h, 0, sizeof(double)*n);
+            for (size_t i = 0; i<k; ++i)
+            {
+                tap_row(h, u + i, rows[t*k + i], n);
+            }
+        }
+
+        #pragma omp parallel for
+        for (size_t y = s; y<input1.h-s; ++y)
+        {
+            double *row = bu.data + y*bu.w + s;
+            for (size_t j = 0; j<k; ++j)
+            {
+                tap_row(row, hor.data + (y+j-r)*hor.w + s, cols[t*k + j], n);
+            }
+        }
+    }
+
+    free_matrix(hor);
+}
+
+/*
+   B*u is computed whichever way needs the fewest multiply-adds per cell:
+   one per nonzero coefficient, 2k per outer product when B has low rank,
+   or a fixed number with FFT, which wins for wide dense templates. A is
+   applied every step, and is split into outer products when that saves
+   work.
+*/
+linear_engine create_linear_engine_nxn(const templatenxn *tmpl, matrix input1, size_t s)
+{
+    linear_engine e = {tmpl->r, tmpl->a, create_matrix(input1.w, input1.h), NULL, NULL, NULL, 0, NULL};
+    const size_t r = tmpl->r,
+                 k = 2*r + 1;
+    double *factors = (double*) malloc(sizeof(double)*2*k*k);
+
+    const size_t rank_b = factorize(tmpl->b, k, factors, factors + k*k);
+    const double direct = nonzeros(tmpl->b, k*k),
+                 separable = 2.0*k*rank_b,
+                 fft = fft_correlate_cost(r);
+    if (fft < direct && fft < separable)
+    {
+        fft_correlate(e.bu, input1, tmpl->b, tmpl->z, r, s);
+    }
+    else if (separable < direct)
+    {
+        feedforward_separable(e.bu, input1, tmpl, s, rank_b, factors, factors + k*k);
+    }
+    else
+    {
+        feedforward_direct(e.bu, input1, tmpl, s);
+    }
+
+    const size_t rank_a = factorize(tmpl->a, k, factors, factors + k*k);
+    if (2*k*rank_a < nonzeros(tmpl->a, k*k))
+    {
+        memmove(factors + rank_a*k, factors + k*k, sizeof(double)*rank_a*k);
+        e.rank = rank_a;
+        e.factors = factors;
+    }
+    else
+    {
+        free(factors);
+    }
+
+    return e;
+}
+
+void free_linear_engine(linear_engine *e)
+{
+    free_matrix(e->bu);
+    free(e->factors);
+}
+
+/*
+   Templates larger than 3x3 keep a ring of 2r+1 output rows and apply A one
+   coefficient at a time, each adding a shifted row to the result, so zero
+   coefficients cost nothing.
+*/
+static void linear_eval_nxn(matrix dx, matrix x, rect r, const linear_engine *e)
+{
+    const size_t n = r.x1 - r.x0,
+                 rad = e->r,
+                 k = 2*rad + 1,
+                 m = n + 2*rad;
+    double *ring = (double*) pool_scratch(SCRATCH_LINEAR, sizeof(double)*k*m);
+
+    for (size_t j = 0; j+1<k; ++j)
+    {
+        output_row(ring + j*m, x.data + (r.y0-rad+j)*x.w + r.x0-rad, m);
+    }
+
+    for (size_t y = r.y0; y<r.y1; ++y)
+    {
+        const size_t i = y - r.y0;
+        output_row(ring + (i+k-1)%k*m, x.data + (y+rad)*x.w + r.x0-rad, m);
+
+        double *d = dx.data + y*dx.w + r.x0;
+        difference_row(d, e->bu.data + y*x.w + r.x0, x.data + y*x.w + r.x0, n);
+        for (size_t j = 0; j<k; ++j)
+        {
+            const double *row = ring + (i+j)%k*m;
+            for (size_t c = 0; c<k; ++c)
+            {
+                if (e->a[j*k + c] != 0)
+                {
+                    tap_row(d, row + c, e->a[j*k + c], n);
+                }
+            }
+        }
+    }
+}
+
+/*
+   A split into outer products keeps, for each product, a ring of 2r+1 rows
+   of phi(x) already weighted by its row factor, so a new row costs k
+   multiply-adds per product and cell, and so does the vertical pass.
+*/
+static void linear_eval_separable(matrix dx, matrix x, rect r, const linear_engine *e)
+{
+    const size_t n = r.x1 - r.x0,
+                 rad = e->r,
+                 k = 2*rad + 1,
+                 m = n + 2*rad,
+                 rank = e->rank;
+    const double *cols = e->factors,
+                 *rows = e->factors + rank*k;
+    double *out = (double*) pool_scratch(SCRATCH_LINEAR, sizeof(double)*(m + rank*k*n)),
+           *ring = out + m;
+
+    for (size_t y = r.y0-rad; y<r.y1+rad; ++y)
+    {
+        const size_t slot = (y - (r.y0-rad)) % k;
+        output_row(out, x.data + y*x.w + r.x0-rad, m);
+        for (size_t t = 0; t<rank; ++t)
+        {
+            double *h = ring + (t*k + slot)*n;
+            memset(h, 0, sizeof(double)*n);
+            for (size_t c = 0; c<k; ++c)
+            {
+                tap_row(h, out + c, rows[t*k + c], n);
+            }
+        }
+
+        if (y < r.y0+rad)
+        {
+            continue;
+        }
+
+        /* the rows y-2r .. y are in the ring, in order from slot y-2r on */
+        const size_t yc = y - rad,
+                     first = (yc - r.y0) % k;
+        double *d = dx.data + yc*dx.w + r.x0;
+        difference_row(d, e->bu.data + yc*x.w + r.x0, x.data + yc*x.w + r.x0, n);
+        for (size_t t = 0; t<rank; ++t)
+        {
+            for (size_t j = 0; j<k; ++j)
+            {
+                tap_row(d, ring + (t*k + (first+j)%k)*n, cols[t*k + j], n);
+            }
+        }
+    }
+}
+
+/*
+   phi(x) is computed once per cell into a ring of three rows, one row ahead
+   of the stencil, so it stays in L1 for all nine of its uses.
+*/
+void linear_eval(matrix dx, matrix x, double t, rect r, void *engine)
+{
+    linear_engine *e = (linear_engine*) engine;
+    if (e->kernel)
+    {
+        e->kernel(dx.data, x.data, e->bu.data, e->u1, e->u2, x.w, r.x0, r.y0, r.x1, r.y1);
+        return;
+    }
+    if (e->rank)
+    {
+        linear_eval_separable(dx, x, r, e);
+        return;
+    }
+    if (e->r != 1)
+    {
+        linear_eval_nxn(dx, x, r, e);
+        return;
+    }
+
+    const size_t n = r.x1 - r.x0;
+    double ring[3][n+2];
+
+    output_row(ring[0], x.data + (r.y0-1)*x.w + r.x0-1, n+2);
+    output_row(ring[1], x.data + r.y0*x.w + r.x0-1, n+2);
+
+    for (size_t y = r.y0; y<r.y1; ++y)
+    {
+        const size_t i = y - r.y0;
+        output_row(ring[(i+2)%3], x.data + (y+1)*x.w + r.x0-1, n+2);
+        linear_row(dx.data + y*dx.w + r.x0, x.data + y*x.w + r.x0,
+                   ring[i%3] + 1, ring[(i+1)%3] + 1, ring[(i+2)%3] + 1,
+                   e->bu.data + y*x.w + r.x0, e->a, n);
+    }
+}
+
+/*
+   The pieces are selected one pass at a time, so every pass is a plain
+   vectorizable loop; buf holds three rows of n.
+*/
+SIMD_CLONES
+static void nonlinear_row(double *restrict dx, const double *restrict kl, const double *restrict ij,
+                          double d, const piecewise *f, double *restrict buf, size_t n)
+{
+    double *restrict v = buf,
+           *restrict s = buf + n,
+           *restrict o = buf + 2*n;
+    const double s_last = f->slope[f->n-1],
+                 o_last = f->offset[f->n-1];
+
+    #pragma omp simd
+    for (size_t i = 0; i<n; ++i)
+    {
+        v[i] = kl[i] - ij[i];
+        s[i] = s_last;
+        o[i] = o_last;
+    }
+
+    for (int p = f->n-2; p>=0; --p)
+    {
+        const double at = f->at[p],
+                     sp = f->slope[p],
+                     op = f->offset[p];
+
+        #pragma omp simd
+        for (size_t i = 0; i<n; ++i)
+        {
+            const int below = v[i] < at;
+            s[i] = below ? sp : s[i];
+            o[i] = below ? op : o[i];
+        }
+    }
+
+    #pragma omp simd
+    for (size_t i = 0; i<n; ++i)
+    {
+        dx[i] += (v[i]*s[i] + o[i])*d;
+    }
+}
+
+static void add_piece(piecewise *f, double at, double slope, double offset)
+{
+    f->at[f->n] = at;
+    f->slope[f->n] = slope;
+    f->offset[f->n] = offset;
+    ++f->n;
+}
+
+/* 0 when phi is not one of the built-in nonlinearities */
+static int create_piecewise(piecewise *f, double (*phi)(double, void*), const double *p)
+{
+    int pieces = 3;
+    if (phi == nonlin_pw_constant)
+    {
+        pieces = (int) p[0]/2 + 1;
+    }
+    else if (phi == nonlin_pw_linear)
+    {
+        pieces = (int) p[0]/3 + 1;
+    }
+
+    f->n = 0;
+    f->at = (double*) malloc(sizeof(double)*3*pieces);
+    f->slope = f->at + pieces;
+    f->offset = f->at + 2*pieces;
+
+    if (phi == nonlin_standard)
+    {
+        add_piece(f, -1, 0, -1);
+        add_piece(f, 1, 1, 0);
+        add_piece(f, 0, 0, 1);
+    }
+    else if (phi == nonlin_sign)
+    {
+        add_piece(f, 0, 0, -1);
+        add_piece(f, 0, 0, 1);
+    }
+    else if (phi == nonlin_absval)
+    {
+        add_piece(f, 0, -1, 0);
+        add_piece(f, 0, 1, 0);
+    }
+    else if (phi == nonlin_pw_constant && (int) p[0] % 2 == 1)
+    {
+        for (int i = 1; i+1<p[0]; i += 2)
+        {
+            add_piece(f, p[i], 0, p[i+1]);
+        }
+        add_piece(f, 0, 0, p[(int) p[0]-1]);
+    }
+    else if (phi == nonlin_pw_linear && (int) p[0] % 3 == 1)
+    {
+        for (int i = 1; i+2<p[0]; i += 3)
+        {
+            add_piece(f, p[i], p[i+1], p[i+2]);
+        }
+        add_piece(f, 0, p[(int) p[0]-2], p[(int) p[0]-1]);
+    }
+    else
+    {
+        free(f->at);
+        return 0;
+    }
+
+    return 1;
+}
+
+int create_nonlinear_engine(nonlinear_engine *e, const templatenxn *tmpl, linear_engine *lin,
+                            matrix input1, matrix input2)
+{
+    e->lin = lin;
+    e->r = tmpl->r;
+    e->d = tmpl->d;
+    e->dij = tmpl->dij;
+    e->dkl = tmpl->dkl;
+    e->input1 = input1;
+    e->input2 = input2;
+    return create_piecewise(&e->f, tmpl->phi, (const double*) tmpl->phi_data);
+}
+
+void free_nonlinear_engine(nonlinear_engine *e)
+{
+    free(e->f.at);
+}
+
+void nonlinear_eval(matrix dx, matrix x, double t, rect r, void *engine)
+{
+    nonlinear_engine *e = (nonlinear_engine*) engine;
+    linear_eval(dx, x, t, r, e->lin);
+
+    const size_t n = r.x1 - r.x0,
+                 rad = e->r,
+                 k = 2*rad + 1,
+                 m = n + 2*rad;
+    const matrix planes[4] = {x, x, e->input1, e->input2},
+                 kl = planes[e->dkl],
+                 ij = planes[e->dij];
+    const int phi_kl = e->dkl == 1;
+    double *ring = (double*) pool_scratch(SCRATCH_NONLINEAR, sizeof(double)*(k*m + 4*n)),
+           *ijb = ring + k*m,
+           *buf = ijb + n;
+
+    for (size_t j = 0; phi_kl && j+1<k; ++j)
+    {
+        output_row(ring + j*m, kl.data + (r.y0-rad+j)*kl.w + r.x0-rad, m);
+    }
+
+    for (size_t y = r.y0; y<r.y1; ++y)
+    {
+        const size_t i = y - r.y0;
+        if (phi_kl)
+        {
+            output_row(ring + (i+k-1)%k*m, kl.data + (y+rad)*kl.w + r.x0-rad, m);
+        }
+
+        const double *c = ij.data + y*ij.w + r.x0;
+        if (e->dij == 1)
+        {
+            output_row(ijb, c, n);
+            c = ijb;
+        }
+
+        double *d = dx.data + y*dx.w + r.x0;
+        for (size_t j = 0; j<k; ++j)
+        {
+            const double *row = phi_kl ? ring + (i+j)%k*m : kl.data + (y+j-rad)*kl.w + r.x0-rad;
+            for (size_t col = 0; col<k; ++col)
+            {
+                if (e->d[j*k + col] != 0)
+                {
+                    nonlinear_row(d, row + col, c, e->d[j*k + col], &e->f, buf, n);
+                }
+            }
+        }
+    }
+}
+
+static void *linear_window_create(void *engine, size_t w, size_t h)
+{
+    linear_engine *local = (linear_engine*) malloc(sizeof(linear_engine));
+    local->r = ((linear_engine*) engine)->r;
+    local->a = ((linear_engine*) engine)->a;
+    local->bu = create_matrix(w, h);
+    local->kernel = ((linear_engine*) engine)->kernel;
+    local->u1 = NULL;
+    local->u2 = NULL;
+    local->rank = ((linear_engine*) engine)->rank;
+    local->factors = ((linear_engine*) engine)->factors;
+    return local;
+}
+
+static void linear_window_gather(void *local, void *engine, const size_t *mx, const size_t *my,
+                                 size_t w, size_t h)
+{
+    linear_engine *l = (linear_engine*) local,
+                  *e = (linear_engine*) engine;
+
+    l->bu.w = w;
+    l->bu.h = h;
+    l->bu.stride = w;
+    for (size_t y = 0; y<h; ++y)
+    {
+        const double *src = e->bu.data + my[y]*e->bu.w;
+        for (size_t x = 0; x<w; ++x)
+        {
+            l->bu.data[y*w + x] = src[mx[x]];
+        }
+    }
+}
+
+/* the factors belong to the engine the window was made from */
+static void linear_window_destroy(void *local)
+{
+    free_matrix(((linear_engine*) local)->bu);
+    free(local);
+}
+
+const window_ops linear_window_ops =
+{
+    linear_window_create,
+    linear_window_gather,
+    linear_window_destroy
+};
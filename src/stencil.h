@@ -0,0 +1,103 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#ifndef CNN_STENCIL_H
+#define CNN_STENCIL_H
+
+#include "cnn.h"
+#include "solver.h"
+
+/*
+   The row kernels are plain loops written so the compiler can vectorize
+   them. On x86-64 GCC additionally builds AVX-512 and AVX2 clones and picks
+   one at load time; everywhere else the default (scalar/SSE2) build is used.
+*/
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#define SIMD_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define SIMD_CLONES
+#endif
+
+/*
+   A generated kernel: stores the derivative for the cells [x0, x1) x
+   [y0, y1) into dx, given the state x, the feedforward term bu and the
+   inputs, all laid out with w cells per row.
+*/
+typedef void (*jit_kernel)(double *restrict dx, const double *restrict x, const double *restrict bu,
+                           const double *restrict u1, const double *restrict u2,
+                           size_t w, size_t x0, size_t y0, size_t x1, size_t y1);
+
+/*
+   Evaluation of a linear template of radius r. The feedforward term
+   B*u + z never changes during a run, so it is computed once into bu; each
+   evaluation only has to compute phi(x) and apply the A stencil. When
+   kernel is set it does both instead, and may also apply the D part of a
+   nonlinear 3x3 template, reading the inputs u1 and u2.
+
+   When A is a sum of few outer products, rank is their number and factors
+   holds their columns and then their rows, each 2r+1 long; A is applied as
+   a horizontal and a vertical pass per product.
+*/
+typedef struct
+{
+    size_t r;
+    const double *a;
+    matrix bu;
+    jit_kernel kernel;
+    const double *u1, *u2;
+    size_t rank;
+    double *factors;
+} linear_engine;
+
+linear_engine create_linear_engine(const template3x3 *tmpl, matrix input1, size_t s);
+linear_engine create_linear_engine_nxn(const templatenxn *tmpl, matrix input1, size_t s);
+void free_linear_engine(linear_engine *e);
+void linear_eval(matrix dx, matrix x, double t, rect r, void *engine);
+
+/*
+   The built-in nonlinearities of D as piecewise linear functions: below
+   at[p], and at or above every earlier threshold, f(v) = v*slope[p] +
+   offset[p]; the last of the n pieces has no threshold. Evaluating this
+   with selects instead of branches reproduces the built-in functions
+   exactly and vectorizes.
+*/
+typedef struct
+{
+    int n;
+    double *at, *slope, *offset;
+} piecewise;
+
+/*
+   Evaluation of a nonlinear template: lin applies A and B, the D part is
+   added row by row. The row the neighbors are compared against (ij) is
+   formed once per row, and phi(x) is kept in a ring like in linear_eval
+   when D reads it.
+*/
+typedef struct
+{
+    linear_engine *lin;
+    size_t r;
+    const double *d;
+    int dij, dkl;
+    piecewise f;
+    matrix input1, input2;
+} nonlinear_engine;
+
+int create_nonlinear_engine(nonlinear_engine *e, const templatenxn *tmpl, linear_engine *lin,
+                            matrix input1, matrix input2);
+void free_nonlinear_engine(nonlinear_engine *e);
+void nonlinear_eval(matrix dx, matrix x, double t, rect r, void *engine);
+
+extern const window_ops linear_window_ops;
+
+#endif
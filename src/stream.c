@@ -0,0 +1,529 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include "stream.h"
+
+/* Grey levels map to the state the way load_image maps luminance. */
+void decode_row(double *dst, const unsigned char *src, size_t n)
+{
+    #pragma omp simd
+    for (size_t i = 0; i<n; ++i)
+    {
+        dst[i] = src[i]/-127.5 + 1;
+    }
+}
+
+void encode_row(unsigned char *dst, const double *src, size_t n)
+{
+    #pragma omp simd
+    for (size_t i = 0; i<n; ++i)
+    {
+        const double g = (src[i]-1)*-127.5 + 0.5;
+        dst[i] = g < 0 ? 0 : (g > 255 ? 255 : g);
+    }
+}
+
+static int read_line(FILE *f, char *line, size_t n)
+{
+    size_t len = 0;
+    int c;
+    while ((c = fgetc(f)) != EOF && c != '\n')
+    {
+        if (len+1 < n)
+        {
+            line[len++] = c;
+        }
+    }
+    line[len] = 0;
+    return c != EOF || len > 0;
+}
+
+/* The size of the chroma planes of a Y4M frame, or -1 for formats that aren't 8 bit. */
+static long chroma_size(const char *c, size_t w, size_t h)
+{
+    if (c && (strstr(c, "p9") || strstr(c, "p1")))
+    {
+        return -1;
+    }
+    if (!c || strncmp(c, "420", 3) == 0)
+    {
+        return 2*((w+1)/2)*((h+1)/2);
+    }
+    if (strcmp(c, "422") == 0)
+    {
+        return 2*((w+1)/2)*h;
+    }
+    if (strcmp(c, "411") == 0)
+    {
+        return 2*((w+3)/4)*h;
+    }
+    if (strcmp(c, "444") == 0)
+    {
+        return 2*w*h;
+    }
+    if (strcmp(c, "444alpha") == 0)
+    {
+        return 3*w*h;
+    }
+    if (strcmp(c, "mono") == 0)
+    {
+        return 0;
+    }
+    return -1;
+}
+
+static int open_y4m(frame_stream *src)
+{
+    char line[1024];
+    if (!read_line(src->file, line, sizeof(line)) || strncmp(line, "YUV4MPEG2", 9) != 0)
+    {
+        fputs("not a Y4M stream\n", stderr);
+        return 0;
+    }
+
+    const char *colorspace = NULL;
+    for (char *tok = strtok(line + 9, " "); tok; tok = strtok(NULL, " "))
+    {
+        if (tok[0] == 'W')
+        {
+            src->w = strtoul(tok + 1, NULL, 10);
+        }
+        else if (tok[0] == 'H')
+        {
+            src->h = strtoul(tok + 1, NULL, 10);
+        }
+        else if (tok[0] == 'F')
+        {
+            snprintf(src->rate, sizeof(src->rate), "%s", tok + 1);
+        }
+        else if (tok[0] == 'C')
+        {
+            colorspace = tok + 1;
+        }
+    }
+
+    const long skip = chroma_size(colorspace, src->w, src->h);
+    if (skip < 0 || src->w == 0 || src->h == 0)
+    {
+        fputs("unsupported Y4M stream\n", stderr);
+        return 0;
+    }
+    src->skip = skip;
+    return 1;
+}
+
+/*
+   Whether a sequence pattern fits into size bytes and has exactly one
+   integer conversion, like %d or %04d, and every other % escaped as %%, so
+   it can be given to snprintf with the frame number.
+*/
+static int check_pattern(const char *pattern, size_t size)
+{
+    if (strlen(pattern) >= size)
+    {
+        return 0;
+    }
+
+    int conversions = 0;
+    for (const char *c = pattern; *c; ++c)
+    {
+        if (*c != '%' || *++c == '%')
+        {
+            continue;
+        }
+        c += strspn(c, "-+ #0");
+        c += strspn(c, "0123456789");
+        if (*c != 'd' && *c != 'i')
+        {
+            return 0;
+        }
+        ++conversions;
+    }
+    return conversions == 1;
+}
+
+static matrix load_frame(frame_stream *src, size_t i)
+{
+    char path[4200];
+    snprintf(path, sizeof(path), src->pattern, (int) i);
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        return NULLMAT;
+    }
+    fclose(f);
+    return load_image(path, src->s);
+}
+
+int open_source(frame_stream *src, const char *path, int format, size_t w, size_t h, size_t s)
+{
+    memset(src, 0, sizeof(frame_stream));
+    src->format = format;
+    src->w = w;
+    src->h = h;
+    src->s = s;
+    snprintf(src->rate, sizeof(src->rate), "25:1");
+
+    if (format == STREAM_IMAGES)
+    {
+        if (!check_pattern(path, sizeof(src->pattern)))
+        {
+            fprintf(stderr, "%s must have one %%d for the frame number and %%%% for every other %%\n", path);
+            return 0;
+        }
+        snprintf(src->pattern, sizeof(src->pattern), "%s", path);
+        src->first = load_frame(src, 0);
+        src->frame = 1;
+        if (!src->first.data)
+        {
+            src->first = load_frame(src, 1);
+            src->frame = 2;
+        }
+        if (!src->first.data)
+        {
+            fprintf(stderr, "no image matches %s\n", path);
+            return 0;
+        }
+        src->w = src->first.w;
+        src->h = src->first.h;
+        return 1;
+    }
+
+    src->file = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!src->file)
+    {
+        perror(path);
+        return 0;
+    }
+    if (format == STREAM_Y4M && !open_y4m(src))
+    {
+        close_stream(src);
+        return 0;
+    }
+    if (src->w == 0 || src->h == 0)
+    {
+        fputs("raw streams need a frame size\n", stderr);
+        close_stream(src);
+        return 0;
+    }
+
+    src->buf = (unsigned char*) malloc(src->w*src->h > src->skip ? src->w*src->h : src->skip);
+    return 1;
+}
+
+int open_sink(frame_stream *dst, const char *path, int format, const frame_stream *src)
+{
+    memset(dst, 0, sizeof(frame_stream));
+    dst->format = format;
+    dst->w = src->w;
+    dst->h = src->h;
+    memcpy(dst->rate, src->rate, sizeof(dst->rate));
+
+    if (format == STREAM_IMAGES)
+    {
+        if (!check_pattern(path, sizeof(dst->pattern)))
+        {
+            fprintf(stderr, "%s must have one %%d for the frame number and %%%% for every other %%\n", path);
+            return 0;
+        }
+        snprintf(dst->pattern, sizeof(dst->pattern), "%s", path);
+        return 1;
+    }
+
+    dst->file = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+    if (!dst->file)
+    {
+        perror(path);
+        return 0;
+    }
+
+    dst->skip = format == STREAM_Y4M ? chroma_size(NULL, dst->w, dst->h) : 0;
+    dst->buf = (unsigned char*) malloc(dst->w*dst->h > dst->skip ? dst->w*dst->h : dst->skip);
+    if (format == STREAM_Y4M)
+    {
+        fprintf(dst->file, "YUV4MPEG2 W%zu H%zu F%s Ip A1:1 C420jpeg\n", dst->w, dst->h, dst->rate);
+    }
+    return 1;
+}
+
+void close_stream(frame_stream *st)
+{
+    if (st->file == stdin || st->file == stdout)
+    {
+        fflush(st->file);
+    }
+    else if (st->file)
+    {
+        fclose(st->file);
+    }
+    free_matrix(st->first);
+    free(st->buf);
+    st->file = NULL;
+    st->first = NULLMAT;
+    st->buf = NULL;
+}
+
+matrix read_frame(frame_stream *src)
+{
+    if (src->format == STREAM_IMAGES)
+    {
+        matrix m = src->first;
+        src->first = NULLMAT;
+        if (!m.data)
+        {
+            m = load_frame(src, src->frame++);
+        }
+        if (m.data && (m.w != src->w || m.h != src->h))
+        {
+            fputs("the images of a sequence must be the same size\n", stderr);
+            free_matrix(m);
+            return NULLMAT;
+        }
+        return m;
+    }
+
+    if (src->format == STREAM_Y4M)
+    {
+        char line[1024];
+        if (!read_line(src->file, line, sizeof(line)) || strncmp(line, "FRAME", 5) != 0)
+        {
+            return NULLMAT;
+        }
+    }
+
+    if (fread(src->buf, 1, src->w*src->h, src->file) != src->w*src->h)
+    {
+        return NULLMAT;
+    }
+
+    matrix m = create_padded_matrix(src->w, src->h, src->s);
+    for (size_t y = 0; y<m.h; ++y)
+    {
+        decode_row(m.data + y*m.stride, src->buf + y*m.w, m.w);
+    }
+
+    /* the chroma planes are read over the luma, which is not needed anymore */
+    if (fread(src->buf, 1, src->skip, src->file) != src->skip)
+    {
+        free_matrix(m);
+        return NULLMAT;
+    }
+    return m;
+}
+
+int write_frame(frame_stream *dst, matrix m)
+{
+    if (dst->format == STREAM_IMAGES)
+    {
+        char path[4200];
+        snprintf(path, sizeof(path), dst->pattern, (int) dst->frame++);
+        return save_matrix(m, path);
+    }
+
+    for (size_t y = 0; y<m.h; ++y)
+    {
+        encode_row(dst->buf + y*m.w, m.data + y*m.stride, m.w);
+    }
+
+    if (dst->format == STREAM_Y4M)
+    {
+        fputs("FRAME\n", dst->file);
+    }
+    if (fwrite(dst->buf, 1, m.w*m.h, dst->file) != m.w*m.h)
+    {
+        return 0;
+    }
+    if (dst->skip)
+    {
+        memset(dst->buf, 128, dst->skip);
+        if (fwrite(dst->buf, 1, dst->skip, dst->file) != dst->skip)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* A bounded queue of frames between two stages of the pipeline; NULLMAT ends it. */
+typedef struct
+{
+    matrix items[STREAM_DEPTH];
+    size_t head, count;
+    mtx_t lock;
+    cnd_t changed;
+} frame_queue;
+
+static void init_queue(frame_queue *q)
+{
+    q->head = 0;
+    q->count = 0;
+    mtx_init(&q->lock, mtx_plain);
+    cnd_init(&q->changed);
+}
+
+static void destroy_queue(frame_queue *q)
+{
+    mtx_destroy(&q->lock);
+    cnd_destroy(&q->changed);
+}
+
+static void push_frame(frame_queue *q, matrix m)
+{
+    mtx_lock(&q->lock);
+    while (q->count == STREAM_DEPTH)
+    {
+        cnd_wait(&q->changed, &q->lock);
+    }
+    q->items[(q->head + q->count) % STREAM_DEPTH] = m;
+    ++q->count;
+    cnd_broadcast(&q->changed);
+    mtx_unlock(&q->lock);
+}
+
+static matrix pop_frame(frame_queue *q)
+{
+    mtx_lock(&q->lock);
+    while (q->count == 0)
+    {
+        cnd_wait(&q->changed, &q->lock);
+    }
+    const matrix m = q->items[q->head];
+    q->head = (q->head + 1) % STREAM_DEPTH;
+    --q->count;
+    cnd_broadcast(&q->changed);
+    mtx_unlock(&q->lock);
+    return m;
+}
+
+typedef struct
+{
+    frame_stream *src, *dst;
+    frame_queue decoded, simulated;
+} pipeline;
+
+static int decode_frames(void *arg)
+{
+    pipeline *p = (pipeline*) arg;
+    matrix m;
+    while ((m = read_frame(p->src)).data)
+    {
+        push_frame(&p->decoded, m);
+    }
+    push_frame(&p->decoded, NULLMAT);
+    return 0;
+}
+
+/*
+   After a failed write the results are still taken, so the simulation
+   doesn't block. Returns whether every frame was written.
+*/
+static int encode_frames(void *arg)
+{
+    pipeline *p = (pipeline*) arg;
+    int ok = 1;
+    matrix m;
+    while ((m = pop_frame(&p->simulated)).data)
+    {
+        if (ok && !write_frame(p->dst, m))
+        {
+            fputs("can't write the output stream\n", stderr);
+            ok = 0;
+        }
+        free_matrix(m);
+    }
+    return ok;
+}
+
+/* Takes the frames of a decoder nothing else reads, so it finishes. */
+static void drain_frames(frame_queue *q)
+{
+    matrix m;
+    while ((m = pop_frame(q)).data)
+    {
+        free_matrix(m);
+    }
+}
+
+long run_stream(frame_stream *src, frame_stream *dst, size_t n, const chain_stage *stages,
+                  matrix *planes, size_t nplanes, size_t frame, size_t warm, size_t s,
+                  run_options opt, run_info *info)
+{
+    pipeline p = {src, dst};
+    init_queue(&p.decoded);
+    init_queue(&p.simulated);
+    thrd_t decoder, encoder;
+    const int decoding = thrd_create(&decoder, decode_frames, &p) == thrd_success,
+              encoding = decoding && thrd_create(&encoder, encode_frames, &p) == thrd_success;
+    if (!encoding)
+    {
+        fputs("can't start the threads of the stream\n", stderr);
+        if (decoding)
+        {
+            drain_frames(&p.decoded);
+            thrd_join(decoder, NULL);
+        }
+        destroy_queue(&p.decoded);
+        destroy_queue(&p.simulated);
+        return -1;
+    }
+
+    for (size_t i = 0; i<n; ++i)
+    {
+        info[i].t = 0;
+        info[i].steps = 0;
+    }
+
+    /* the result a frame leaves for the next one is a copy, as the encoder frees the result */
+    matrix previous = NULLMAT,
+           m;
+    long frames = 0;
+    run_info *last = (run_info*) malloc(sizeof(run_info)*n);
+    while ((m = pop_frame(&p.decoded)).data)
+    {
+        planes[frame] = matrix_plane(m);
+        if (warm < nplanes)
+        {
+            planes[warm] = previous.data ? previous : planes[frame];
+        }
+
+        const matrix res = run_chain(n, stages, planes, nplanes, s, opt, last, update_nothing, NULL);
+        for (size_t i = 0; i<n; ++i)
+        {
+            info[i].t = last[i].t;
+            info[i].steps += last[i].steps;
+        }
+
+        if (warm < nplanes)
+        {
+            free_matrix(previous);
+            previous = copy_matrix(res);
+        }
+        free_matrix(m);
+        push_frame(&p.simulated, matrix_interior(res, s));
+        ++frames;
+    }
+    push_frame(&p.simulated, NULLMAT);
+
+    int written;
+    thrd_join(decoder, NULL);
+    thrd_join(encoder, &written);
+    destroy_queue(&p.decoded);
+    destroy_queue(&p.simulated);
+    free_matrix(previous);
+    free(last);
+    return written ? frames : -1;
+}
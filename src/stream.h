@@ -0,0 +1,75 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#ifndef CNN_STREAM_H
+#define CNN_STREAM_H
+
+#include <stdio.h>
+#include "cnn.h"
+
+/*
+   Raw streams are 8 bit grey frames of a size given by the caller, one
+   after another. Y4M streams carry their size in their header; only the
+   luma plane is read, and written frames get neutral chroma. Image
+   sequences are files named by a printf pattern with the frame number,
+   starting at 0 or 1.
+*/
+#define STREAM_RAW 0
+#define STREAM_Y4M 1
+#define STREAM_IMAGES 2
+
+/* How many frames may wait between two stages of the pipeline. */
+#define STREAM_DEPTH 2
+
+typedef struct
+{
+    int format;
+    FILE *file;
+    char pattern[4096];
+    size_t w, h, s;
+    size_t frame;
+    size_t skip;
+    char rate[32];
+    unsigned char *buf;
+    matrix first;
+} frame_stream;
+
+/* n grey levels to states and back, as raw and Y4M frames are read and written. */
+void decode_row(double *dst, const unsigned char *src, size_t n);
+void encode_row(unsigned char *dst, const double *src, size_t n);
+
+/* "-" is the standard input or output. Both return 0 and print why if they fail. */
+int open_source(frame_stream *src, const char *path, int format, size_t w, size_t h, size_t s);
+int open_sink(frame_stream *dst, const char *path, int format, const frame_stream *src);
+void close_stream(frame_stream *st);
+
+/* The next frame with a halo of src->s, or NULLMAT at the end of the stream. */
+matrix read_frame(frame_stream *src);
+/* Returns 0 if the frame can't be written. */
+int write_frame(frame_stream *dst, matrix m);
+
+/*
+   Run a template chain on every frame of src and write the results to dst.
+   Frames are decoded and encoded on threads of their own, while the chain
+   runs on the calling one. planes is laid out as for run_chain; each frame
+   is put at planes[frame]. When warm is a plane index, the result of the
+   previous frame is put there, the frame itself for the first one. The
+   steps of each stage are summed over the frames in info, and t is that of
+   the last frame. Returns the number of frames, or -1 if the threads can't
+   be started or a frame can't be written.
+*/
+long run_stream(frame_stream *src, frame_stream *dst, size_t n, const chain_stage *stages,
+                  matrix *planes, size_t nplanes, size_t frame, size_t warm, size_t s,
+                  run_options opt, run_info *info);
+
+#endif
@@ -0,0 +1,293 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tiled.h"
+#include "stream.h"
+#include "solver.h"
+
+static size_t sample_size(int format)
+{
+    return format == SAMPLE_F64 ? sizeof(double) : 1;
+}
+
+static int map_fd(mapped_plane *p, int fd, int format, size_t w, size_t h, int writable)
+{
+    const size_t bytes = w*h*sample_size(format);
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (writable && ftruncate(fd, bytes) < 0))
+    {
+        perror("can't map the image");
+        return 0;
+    }
+    if (!writable && (size_t) st.st_size < bytes)
+    {
+        fprintf(stderr, "the image is smaller than %zux%zu\n", w, h);
+        return 0;
+    }
+
+    void *data = mmap(NULL, bytes, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        perror("can't map the image");
+        return 0;
+    }
+
+    *p = (mapped_plane) {format, w, h, (unsigned char*) data, bytes};
+    return 1;
+}
+
+int map_plane(mapped_plane *p, const char *path, int format, size_t w, size_t h, int writable)
+{
+    if (w == 0 || h == 0)
+    {
+        fputs("mapped images need a size\n", stderr);
+        return 0;
+    }
+
+    const int fd = writable ? open(path, O_RDWR | O_CREAT, 0666) : open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(path);
+        return 0;
+    }
+    const int ok = map_fd(p, fd, format, w, h, writable);
+    close(fd);
+    return ok;
+}
+
+int map_scratch(mapped_plane *p, const char *dir, size_t w, size_t h)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/.pycnn-XXXXXX", dir);
+    const int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        perror(dir);
+        return 0;
+    }
+    unlink(path);
+    const int ok = map_fd(p, fd, SAMPLE_F64, w, h, 1);
+    close(fd);
+    return ok;
+}
+
+void unmap_plane(mapped_plane *p)
+{
+    if (p->data)
+    {
+        munmap(p->data, p->bytes);
+        p->data = NULL;
+    }
+}
+
+static size_t wrap_index(long i, size_t n)
+{
+    const long m = i % (long) n;
+    return m < 0 ? m + n : m;
+}
+
+void read_window(matrix plane, size_t s, const mapped_plane *src, long x0, long y0, int wrap)
+{
+    const size_t w = plane.w - 2*s,
+                 h = plane.h - 2*s,
+                 size = sample_size(src->format);
+
+    #pragma omp parallel for
+    for (size_t y = 0; y<h; ++y)
+    {
+        const size_t sy = wrap ? wrap_index(y0 + (long) y, src->h) : y0 + y;
+        double *dst = plane.data + (y+s)*plane.w + s;
+        for (size_t x = 0; x<w;)
+        {
+            const size_t sx = wrap ? wrap_index(x0 + (long) x, src->w) : x0 + x,
+                         n = w-x < src->w-sx ? w-x : src->w-sx;
+            const unsigned char *row = src->data + (sy*src->w + sx)*size;
+            if (src->format == SAMPLE_F64)
+            {
+                memcpy(dst + x, row, n*sizeof(double));
+            }
+            else
+            {
+                decode_row(dst + x, row, n);
+            }
+            x += n;
+        }
+    }
+}
+
+void write_window(mapped_plane *dst, matrix plane, size_t px, size_t py, size_t x0, size_t y0,
+                  size_t w, size_t h)
+{
+    const size_t size = sample_size(dst->format);
+
+    #pragma omp parallel for
+    for (size_t y = 0; y<h; ++y)
+    {
+        const double *src = plane.data + (py+y)*plane.w + px;
+        unsigned char *row = dst->data + ((y0+y)*dst->w + x0)*size;
+        if (dst->format == SAMPLE_F64)
+        {
+            memcpy(row, src, w*sizeof(double));
+        }
+        else
+        {
+            encode_row(row, src, w);
+        }
+    }
+}
+
+/* The window of the tile at (x, y) along one axis: its start and length. */
+static void window(size_t x, size_t n, size_t size, size_t margin, int wrap, long *start, size_t *len)
+{
+    if (wrap)
+    {
+        *start = (long) x - (long) margin;
+        *len = n + 2*margin;
+        return;
+    }
+
+    const size_t a = x > margin ? x - margin : 0,
+                 b = x+n+margin < size ? x+n+margin : size;
+    *start = a;
+    *len = b-a;
+}
+
+int run_tiled(const mapped_plane *init, const mapped_plane *input1, const mapped_plane *input2,
+              mapped_plane *out, size_t s, double (*cell)(size_t, size_t, matrix, matrix, matrix, double, void*),
+              void *cell_data, void (*bnd)(matrix, size_t), double fill, double dt, double t_end,
+              int solver, run_options opt, size_t tile, size_t pass_steps, const char *scratch_dir,
+              run_info *info)
+{
+    const size_t w = init->w,
+                 h = init->h;
+    if (solver == SOLVER_RK45)
+    {
+        fputs("runs with an adaptive step size can't be split into tiles\n", stderr);
+        return 0;
+    }
+    if (input1->w != w || input1->h != h || input2->w != w || input2->h != h || out->w != w || out->h != h)
+    {
+        fputs("the images must be the same size\n", stderr);
+        return 0;
+    }
+
+    /* the steps are counted the same way run_cnn counts them */
+    size_t steps = 0;
+    double t = 0;
+    while (t<t_end)
+    {
+        t += dt;
+        ++steps;
+    }
+
+    /* how far the steps of a pass can carry a wrong value in from the edge of a window */
+    tile = tile > 0 ? tile : 1;
+    const size_t reach = schemes[solver].n*s;
+    if (pass_steps == 0)
+    {
+        pass_steps = tile/8/reach > 0 ? tile/8/reach : 1;
+    }
+    const int wrap = bnd == bound_periodic;
+    /* a pass takes all of its steps, or the tiles would be out of step */
+    opt.conv = NOCONV;
+
+    mapped_plane scratch[2] = {{0}, {0}};
+    int ok = 1;
+    size_t done = 0;
+    do
+    {
+        const size_t n = steps-done < pass_steps ? steps-done : pass_steps,
+                     margin = n*reach;
+        const int last = done+n == steps;
+        const mapped_plane *src = done == 0 ? init : &scratch[(done/pass_steps + 1) % 2];
+        mapped_plane *dst = last ? out : &scratch[done/pass_steps % 2];
+        if (!last && !dst->data && !map_scratch(dst, scratch_dir, w, h))
+        {
+            ok = 0;
+            break;
+        }
+
+        for (size_t ty = 0; ty<h; ty += tile)
+        {
+            for (size_t tx = 0; tx<w; tx += tile)
+            {
+                const size_t tw = w-tx < tile ? w-tx : tile,
+                             th = h-ty < tile ? h-ty : tile;
+                long x0, y0;
+                size_t ww, wh;
+                window(tx, tw, w, margin, wrap, &x0, &ww);
+                window(ty, th, h, margin, wrap, &y0, &wh);
+
+                const matrix x = matrix_plane(create_padded_matrix(ww, wh, s));
+                read_window(x, s, src, x0, y0, wrap);
+                matrix u1 = x,
+                       u2 = x;
+                if (input1 != init || done > 0)
+                {
+                    u1 = matrix_plane(create_padded_matrix(ww, wh, s));
+                    read_window(u1, s, input1, x0, y0, wrap);
+                }
+                if (input2 == input1)
+                {
+                    u2 = u1;
+                }
+                else if (input2 != init || done > 0)
+                {
+                    u2 = matrix_plane(create_padded_matrix(ww, wh, s));
+                    read_window(u2, s, input2, x0, y0, wrap);
+                }
+                fill_bounds(x, s, fill);
+                fill_bounds(u1, s, fill);
+                fill_bounds(u2, s, fill);
+
+                /* exactly n steps, whatever the rounding of t */
+                run_info pass;
+                const matrix res = (last ? run_cnn : run_cnn_state)(x, u1, u2, s, cell, cell_data, bnd, dt,
+                                                                    (n-0.5)*dt, solver, opt, &pass,
+                                                                    update_nothing, NULL);
+                write_window(dst, res, s + (size_t) ((long) tx - x0), s + (size_t) ((long) ty - y0), tx, ty, tw, th);
+
+                free_matrix(res);
+                if (u2.data != x.data && u2.data != u1.data)
+                {
+                    free_matrix(u2);
+                }
+                if (u1.data != x.data)
+                {
+                    free_matrix(u1);
+                }
+                free_matrix(x);
+            }
+        }
+        done += n;
+    } while (done<steps && ok);
+
+    unmap_plane(&scratch[0]);
+    unmap_plane(&scratch[1]);
+
+    if (info)
+    {
+        info->t = t;
+        info->steps = steps;
+    }
+    return ok;
+}
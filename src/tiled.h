@@ -0,0 +1,69 @@
+/*
+   Copyright (C) 2015 by Boldizsár Lipka <lipkab@zoho.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY.
+
+   See the COPYING file for more details.
+*/
+
+#ifndef CNN_TILED_H
+#define CNN_TILED_H
+
+#include "cnn.h"
+
+/*
+   Raw files hold w x h samples row by row, either 8 bit grey levels like
+   raw streams, or native doubles in the range of the state.
+*/
+#define SAMPLE_U8 0
+#define SAMPLE_F64 1
+
+typedef struct
+{
+    int format;
+    size_t w, h;
+    unsigned char *data;
+    size_t bytes;
+} mapped_plane;
+
+/*
+   Map a raw file; a writable one is created or resized to fit. Scratch
+   planes hold doubles in an unnamed file in dir. Both return 0 and print
+   why if they fail.
+*/
+int map_plane(mapped_plane *p, const char *path, int format, size_t w, size_t h, int writable);
+int map_scratch(mapped_plane *p, const char *dir, size_t w, size_t h);
+void unmap_plane(mapped_plane *p);
+
+/*
+   The interior of plane from the samples of src starting at (x0, y0),
+   taken modulo the size of src when wrap is set, and the w x h cells of
+   plane at (px, py) into dst at (x0, y0).
+*/
+void read_window(matrix plane, size_t s, const mapped_plane *src, long x0, long y0, int wrap);
+void write_window(mapped_plane *dst, matrix plane, size_t px, size_t py, size_t x0, size_t y0,
+                  size_t w, size_t h);
+
+/*
+   Run a template on images that stay in mapped files, so only a few tiles
+   have to fit into memory. The run is split into passes of pass_steps
+   steps, or as many as fit into a margin of an eighth of a tile when it is
+   0. Every pass simulates the tiles one after another, each with a margin
+   of the cells its steps can reach around it, and keeps only the tile
+   itself, so the result is that of the whole image. The state between
+   passes is kept in scratch files in scratch_dir. Only the fixed step
+   solvers can be split this way; the t of the cell functions starts from 0
+   in every pass, and the convergence of opt is ignored. Returns 0 and prints why if the run can't be done.
+*/
+int run_tiled(const mapped_plane *init, const mapped_plane *input1, const mapped_plane *input2,
+              mapped_plane *out, size_t s, double (*cell)(size_t, size_t, matrix, matrix, matrix, double, void*),
+              void *cell_data, void (*bnd)(matrix, size_t), double fill, double dt, double t_end,
+              int solver, run_options opt, size_t tile, size_t pass_steps, const char *scratch_dir,
+              run_info *info);
+
+#endif